@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+#include "ipc.h"
+#include "ipc-unix.h"
+#include "ipc-client.h"
+#include "ipc-server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct udp_receiver {
+	int fd;
+	unsigned long msgs;
+	unsigned long dgrams;
+	unsigned long errors;
+	double last;
+};
+
+static int udp_receive_thread(void *arg)
+{
+	struct udp_receiver *r = arg;
+	static char bufs[16][IPC_UDP_MAX];
+	struct ipc_dgram v[16];
+	for (int i = 0; i < 16; i++) {
+		v[i].buf = bufs[i];
+		v[i].cap = sizeof(bufs[i]);
+	}
+
+	for (;;) {
+		// SO_RCVTIMEO ends the run once the sender has gone quiet
+		int n = ipc_dgram_recv(r->fd, v, 16);
+		if (n <= 0) {
+			break;
+		}
+		r->dgrams += n;
+		for (int i = 0; i < n; i++) {
+			sipc_unframer_t u;
+			sipc_parser_t p;
+			int sz;
+			sipc_unframe_init(&u, v[i].buf, v[i].len);
+			while ((sz = sipc_unframe_next(&u, &p)) > 0) {
+				if (sipc_start(&p) == SIPC_REQUEST && !sipc_end(&p)) {
+					r->msgs++;
+				} else {
+					r->errors++;
+				}
+			}
+			if (sz < 0) {
+				r->errors++;
+			}
+		}
+		r->last = now();
+	}
+	return 0;
+}
+
+static int bench_udp(unsigned long count, int payload, bool packed)
+{
+	int rfd = ipc_udp_bind("127.0.0.1", "0");
+	if (rfd < 0) {
+		perror("bind");
+		return 2;
+	}
+	int rcvbuf = 8 << 20;
+	struct timeval tv = { .tv_usec = 200 * 1000 };
+	setsockopt(rfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(rfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	getsockname(rfd, (struct sockaddr *)&sa, &salen);
+	char port[16];
+	snprintf(port, sizeof(port), "%d", ntohs(sa.sin_port));
+
+	int sfd = ipc_udp_connect("127.0.0.1", port);
+	if (sfd < 0) {
+		perror("connect");
+		return 2;
+	}
+
+	struct udp_receiver r = { .fd = rfd };
+	thrd_t thread;
+	if (thrd_create(&thread, &udp_receive_thread, &r) != thrd_success) {
+		perror("thread");
+		return 2;
+	}
+
+	static char dgram[IPC_UDP_MAX];
+	char *data = malloc(payload);
+	memset(data, 'x', payload);
+	struct ipc_dgram_packer w;
+	ipc_dgram_init(&w, sfd, dgram, sizeof(dgram));
+
+	double start = now();
+	for (unsigned long i = 0; i < count; i++) {
+		if (ipc_dgram_format(&w, "R 6:metric %lu %*p\n", i, payload,
+				     data)) {
+			perror("send");
+			return 3;
+		}
+		if (!packed && ipc_dgram_flush(&w)) {
+			perror("send");
+			return 3;
+		}
+	}
+	ipc_dgram_flush(&w);
+	double sent = now();
+
+	thrd_join(thread, NULL);
+	double elapsed = r.last - start;
+	printf("udp %-8s sent %lu msgs in %lu dgrams (%.0f msgs/s), "
+	       "received %lu msgs in %lu dgrams (%.0f msgs/s), %lu errors\n",
+	       packed ? "packed" : "single", count, w.sent,
+	       count / (sent - start), r.msgs, r.dgrams,
+	       elapsed > 0 ? r.msgs / elapsed : 0, r.errors);
+
+	free(data);
+	close(sfd);
+	close(rfd);
+	return 0;
+}
+
+struct stream_server {
+	int fd;
+	const char *path;
+	bool splice;
+};
+
+static long long read_write(int in, int out)
+{
+	static char buf[64 * 1024];
+	long long total = 0;
+	ssize_t r;
+	while ((r = read(in, buf, sizeof(buf))) > 0) {
+		if (out >= 0 && write(out, buf, r) != r) {
+			return -1;
+		}
+		total += r;
+	}
+	return r ? -1 : total;
+}
+
+static int stream_server_thread(void *arg)
+{
+	struct stream_server *s = arg;
+	char buf[256];
+	int pfd, fdn = 1;
+	int r = ipc_unix_recvmsg(s->fd, buf, sizeof(buf), &pfd, &fdn);
+	if (r <= 0 || fdn != 1) {
+		return 1;
+	}
+	int file = open(s->path, O_RDONLY);
+	long long n = s->splice ? ipc_stream_copy(file, pfd, -1) :
+				  read_write(file, pfd);
+	if (n < 0) {
+		perror("server copy");
+	}
+	close(file);
+	close(pfd);
+	return 0;
+}
+
+static int bench_stream(long long size, bool splice)
+{
+	char path[] = "/tmp/c-bench-XXXXXX";
+	int file = mkstemp(path);
+	if (file < 0) {
+		perror("mkstemp");
+		return 2;
+	}
+	static char block[1 << 20];
+	memset(block, 'x', sizeof(block));
+	for (long long n = 0; n < size; n += sizeof(block)) {
+		if (write(file, block, sizeof(block)) != sizeof(block)) {
+			perror("write");
+			return 2;
+		}
+	}
+	close(file);
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+		perror("socketpair");
+		return 2;
+	}
+
+	struct stream_server s = {
+		.fd = sv[1],
+		.path = path,
+		.splice = splice,
+	};
+	thrd_t thread;
+	if (thrd_create(&thread, &stream_server_thread, &s) != thrd_success) {
+		perror("thread");
+		return 2;
+	}
+
+	// the client end writes to a file as /dev/null would discard
+	// spliced pages without touching them
+	char outpath[] = "/tmp/c-bench-out-XXXXXX";
+	int out = mkstemp(outpath);
+	if (out < 0) {
+		perror("mkstemp");
+		return 2;
+	}
+	double start = now();
+	static const char req[] = "R 6:export\n";
+	int pfd = ipc_stream_send(sv[0], req, sizeof(req) - 1, false);
+	if (pfd < 0) {
+		perror("stream");
+		return 3;
+	}
+	long long n = splice ? ipc_stream_copy(pfd, out, -1) :
+			       read_write(pfd, out);
+	double elapsed = now() - start;
+	thrd_join(thread, NULL);
+
+	printf("stream %-10s %lld bytes in %.3fs (%.2f GB/s)\n",
+	       splice ? "splice" : "read/write", n, elapsed,
+	       n / elapsed / 1e9);
+
+	close(pfd);
+	close(out);
+	close(sv[0]);
+	close(sv[1]);
+	unlink(path);
+	unlink(outpath);
+	return n == size ? 0 : 3;
+}
+
+// burns roughly the requested number of microseconds of CPU
+static void work_handler(void *udata, struct ipc_request *r,
+			 sipc_parser_t *args)
+{
+	uint64_t us;
+	if (sipc_uint64(args, &us) || sipc_end(args)) {
+		ipc_error(r, "malformed", NULL);
+		return;
+	}
+	double end = now() + us / 1e6;
+	volatile unsigned long x = 0;
+	while (now() < end) {
+		for (int i = 0; i < 1000; i++) {
+			x += i;
+		}
+	}
+	ipc_reply(r, "S %llu\n", (unsigned long long)us);
+}
+
+struct server_client {
+	unsigned long done;
+	unsigned long errors;
+};
+
+static void server_reply(void *udata, sipc_parser_t *reply, const int *fds,
+			 int fdn)
+{
+	struct server_client *c = udata;
+	c->done++;
+	if (!reply || sipc_start(reply) != SIPC_SUCCESS) {
+		c->errors++;
+	}
+}
+
+static int bench_server(int threads, bool per_core, unsigned long count, int us,
+			int window)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/c-bench-%d.sock", (int)getpid());
+	unlink(path);
+	int lfd = ipc_unix_listen(path);
+	if (lfd < 0) {
+		perror("listen");
+		return 2;
+	}
+
+	struct ipc_server_config cfg = {
+		.io_threads = per_core ? threads : 1,
+		.workers = threads,
+		.per_core = per_core,
+		.balance = IPC_LEAST_LOADED,
+	};
+	struct ipc_server *srv = ipc_server_new(&cfg);
+	if (!srv || ipc_server_handle(srv, "work", &work_handler, NULL) ||
+	    ipc_server_start(srv, lfd)) {
+		perror("server");
+		return 2;
+	}
+
+	// one connection per thread so that thread-per-core mode spreads the
+	// load
+	struct ipc_client *c[64];
+	struct pollfd pfds[64];
+	int cn = threads < 64 ? threads : 64;
+	for (int i = 0; i < cn; i++) {
+		c[i] = ipc_client_connect(path);
+		if (!c[i]) {
+			perror("connect");
+			return 2;
+		}
+		pfds[i].fd = ipc_client_fd(c[i]);
+		pfds[i].events = POLLIN;
+	}
+
+	struct server_client sc = { 0 };
+	unsigned long sent = 0;
+	double start = now();
+	while (sc.done < count) {
+		// keep window requests in flight
+		while (sent < count && sent - sc.done < (unsigned long)window) {
+			if (ipc_client_submit(c[sent % cn], &server_reply, &sc,
+					      "R 4:work %d\n", us)) {
+				perror("submit");
+				return 3;
+			}
+			sent++;
+		}
+		poll(pfds, cn, -1);
+		for (int i = 0; i < cn; i++) {
+			if (ipc_client_dispatch(c[i])) {
+				fprintf(stderr, "connection failed\n");
+				return 3;
+			}
+		}
+	}
+	double elapsed = now() - start;
+
+	printf("server %-8s %2d threads %lu requests of %dus in %.3fs "
+	       "(%.0f req/s), %lu errors\n",
+	       per_core ? "per-core" : "workers", threads, count, us, elapsed,
+	       count / elapsed, sc.errors);
+
+	for (int i = 0; i < cn; i++) {
+		ipc_client_free(c[i]);
+	}
+
+	struct ipc_io_stats st[64];
+	int stn = ipc_server_io_stats(srv, st, 64);
+	for (int i = 0; i < stn && i < 64; i++) {
+		printf("  io thread %d cpu %d node %d accepted %lu "
+		       "requests %lu\n",
+		       i, st[i].cpu, st[i].node, st[i].accepted,
+		       st[i].requests);
+	}
+	ipc_server_stop(srv);
+	ipc_server_free(srv);
+	unlink(path);
+	return sc.errors ? 3 : 0;
+}
+
+static void ping_handler(void *udata, struct ipc_request *r,
+			 sipc_parser_t *args)
+{
+	ipc_reply(r, "S\n");
+}
+
+struct prio_bench {
+	unsigned long bulk_done;
+	bool ping_out;
+	double ping_sent;
+	int latn;
+	double lat[100000];
+};
+
+static void bulk_reply(void *udata, sipc_parser_t *reply, const int *fds,
+		       int fdn)
+{
+	struct prio_bench *b = udata;
+	b->bulk_done++;
+}
+
+static void ping_reply(void *udata, sipc_parser_t *reply, const int *fds,
+		       int fdn)
+{
+	struct prio_bench *b = udata;
+	b->lat[b->latn++] = now() - b->ping_sent;
+	b->ping_out = false;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Measures ping latency while bulk requests saturate the workers
+static int bench_priority(enum ipc_priority ping_prio, int pings, int us)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/c-bench-%d.sock", (int)getpid());
+	unlink(path);
+	int lfd = ipc_unix_listen(path);
+	if (lfd < 0) {
+		perror("listen");
+		return 2;
+	}
+
+	struct ipc_server_config cfg = { .io_threads = 1, .workers = 2 };
+	struct ipc_server *srv = ipc_server_new(&cfg);
+	if (!srv ||
+	    ipc_server_handle_priority(srv, "work", &work_handler, NULL,
+				       IPC_PRIORITY_BULK) ||
+	    ipc_server_handle_priority(srv, "ping", &ping_handler, NULL,
+				       ping_prio) ||
+	    ipc_server_start(srv, lfd)) {
+		perror("server");
+		return 2;
+	}
+
+	struct ipc_client *bulk = ipc_client_connect(path);
+	struct ipc_client *ping = ipc_client_connect(path);
+	if (!bulk || !ping) {
+		perror("connect");
+		return 2;
+	}
+
+	static struct prio_bench b;
+	memset(&b, 0, sizeof(b));
+	if (pings > (int)(sizeof(b.lat) / sizeof(b.lat[0]))) {
+		pings = sizeof(b.lat) / sizeof(b.lat[0]);
+	}
+	unsigned long bulk_sent = 0;
+	struct pollfd pfds[2] = {
+		{ .fd = ipc_client_fd(bulk), .events = POLLIN },
+		{ .fd = ipc_client_fd(ping), .events = POLLIN },
+	};
+	while (b.latn < pings) {
+		// keep the workers saturated with a deep bulk queue
+		while (bulk_sent - b.bulk_done < 64) {
+			if (ipc_client_submit(bulk, &bulk_reply, &b,
+					      "R 4:work %d\n", us)) {
+				perror("submit");
+				return 3;
+			}
+			bulk_sent++;
+		}
+		if (!b.ping_out) {
+			b.ping_out = true;
+			b.ping_sent = now();
+			if (ipc_client_submit(ping, &ping_reply, &b,
+					      "R 4:ping\n")) {
+				perror("submit");
+				return 3;
+			}
+		}
+		poll(pfds, 2, -1);
+		if (ipc_client_dispatch(bulk) || ipc_client_dispatch(ping)) {
+			fprintf(stderr, "connection failed\n");
+			return 3;
+		}
+	}
+
+	qsort(b.lat, b.latn, sizeof(b.lat[0]), &cmp_double);
+	printf("priority ping %-6s p50 %.3fms p99 %.3fms max %.3fms "
+	       "(%lu bulk requests of %dus)\n",
+	       ping_prio == IPC_PRIORITY_HIGH ? "high" : "bulk",
+	       b.lat[b.latn / 2] * 1e3, b.lat[b.latn * 99 / 100] * 1e3,
+	       b.lat[b.latn - 1] * 1e3, b.bulk_done, us);
+
+	// let the remaining bulk requests drain before stopping
+	while (b.bulk_done < bulk_sent) {
+		poll(pfds, 1, -1);
+		ipc_client_dispatch(bulk);
+	}
+	ipc_client_free(bulk);
+	ipc_client_free(ping);
+	ipc_server_stop(srv);
+	ipc_server_free(srv);
+	unlink(path);
+	return 0;
+}
+
+static int usage(void)
+{
+	fprintf(stderr, "usage: c-bench udp [count] [payload]\n"
+			"       c-bench stream [megabytes]\n"
+			"       c-bench server [count] [microseconds] [workers]\n"
+			"       c-bench priority [pings] [microseconds]\n");
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		return usage();
+	}
+	if (!strcmp(argv[1], "udp")) {
+		unsigned long count = argc > 2 ? strtoul(argv[2], NULL, 0) :
+						 1000000;
+		int payload = argc > 3 ? atoi(argv[3]) : 32;
+		return bench_udp(count, payload, false) ||
+		       bench_udp(count, payload, true);
+	}
+	if (!strcmp(argv[1], "stream")) {
+		long long mb = argc > 2 ? atoll(argv[2]) : 256;
+		return bench_stream(mb << 20, false) ||
+		       bench_stream(mb << 20, true);
+	}
+	if (!strcmp(argv[1], "server")) {
+		unsigned long count = argc > 2 ? strtoul(argv[2], NULL, 0) :
+						 20000;
+		int us = argc > 3 ? atoi(argv[3]) : 50;
+		int max = argc > 4 ? atoi(argv[4]) :
+				     (int)sysconf(_SC_NPROCESSORS_ONLN);
+		for (int n = 1; n <= max; n *= 2) {
+			if (bench_server(n, false, count, us, 4 * max) ||
+			    bench_server(n, true, count, us, 4 * max)) {
+				return 3;
+			}
+		}
+		return 0;
+	}
+	if (!strcmp(argv[1], "priority")) {
+		int pings = argc > 2 ? atoi(argv[2]) : 200;
+		int us = argc > 3 ? atoi(argv[3]) : 500;
+		return bench_priority(IPC_PRIORITY_BULK, pings, us) ||
+		       bench_priority(IPC_PRIORITY_HIGH, pings, us);
+	}
+	return usage();
+}
@@ -62,7 +62,8 @@ int main(int argc, const char *argv[])
 	fprintf(stderr, "wait complete: %s\n", buf);
 
 #else
-	int fd = ipc_unix_connect("sock");
+	// wait for the server to come up, e.g. when both are started together
+	int fd = ipc_unix_connect_wait("sock", 5000);
 	if (fd < 0) {
 		perror("connect");
 		return 2;
@@ -70,14 +71,23 @@ int main(int argc, const char *argv[])
 
 	send(fd, test, strlen(test), 0);
 
-	int fds[2];
-	pipe(fds);
-
 	int n = sipc_format(buf, sizeof(buf), "R 3:cmd %d %f %f\n", -123,
 			    312132.1f, NAN);
-	ipc_unix_sendmsg(fd, buf, n, &fds[1], 1);
-	close(fds[1]);
-	read(fds[0], buf, sizeof(buf));
+	int pfd = ipc_stream_send(fd, buf, n, false);
+	if (pfd >= 0) {
+		read(pfd, buf, sizeof(buf));
+		close(pfd);
+	}
+
+	int nfd = ipc_unix_dgram_connect("sock.notify");
+	if (nfd >= 0) {
+		struct ipc_dgram_packer w;
+		ipc_dgram_init(&w, nfd, buf, sizeof(buf));
+		ipc_dgram_format(&w, "R 6:notify %d\n", 1);
+		ipc_dgram_format(&w, "R 6:notify %d\n", 2);
+		ipc_dgram_flush(&w);
+		close(nfd);
+	}
 #endif
 	return 0;
 }
@@ -0,0 +1,843 @@
+// Connection multiplexing proxy. Each service is exposed on a local socket
+// and forwarded over a few long lived upstream connections, so that a
+// service sees a handful of connections however many short lived tools
+// talk to it. Only the request ID line is looked at. Every request is
+// tagged with a proxy wide ID upstream, replies are routed back by it and
+// untagged requests are put back into order per client. File descriptors
+// are passed through and messages are moved in batches with
+// recvmmsg/sendmmsg.
+#define _GNU_SOURCE
+#include "ipc.h"
+#include "ipc-unix.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define BUFSZ 65536
+#define MAX_FDS 16
+// messages moved per recvmmsg/sendmmsg
+#define BATCH 32
+// messages queued for a socket before the proxy stops reading more
+#define MAX_BACKLOG 256
+#define RETRY_MS 100
+#define EVENT_BATCH 64
+
+enum kind {
+	LISTENER,
+	CLIENT,
+	UPSTREAM,
+};
+
+// an owned message waiting for a socket
+struct msg {
+	struct msg *next;
+	int len;
+	int fdn;
+	int fds[MAX_FDS];
+	char buf[];
+};
+
+struct queue {
+	struct msg *head;
+	struct msg **tail;
+	int n;
+};
+
+struct peer {
+	enum kind kind;
+	int fd;
+	unsigned events;
+	struct queue out;
+	bool dirty;
+	struct peer *dnext;
+};
+
+struct client;
+
+// a request forwarded upstream, until its final reply
+struct call {
+	uint64_t id;
+	struct client *c;
+	bool tagged;
+	// untagged only: the next request in the client's order, and the
+	// replies held back until the earlier requests have completed
+	struct call *next;
+	struct queue held;
+	bool done;
+	// the client's own request ID line
+	int idlen;
+	char idline[32];
+};
+
+struct service;
+
+struct upstream {
+	struct peer p;
+	struct service *s;
+	const char *path;
+	uint64_t next_id;
+	// open addressed table of calls keyed by upstream request ID
+	struct call **tbl;
+	size_t mask;
+	size_t used;
+};
+
+struct client {
+	struct peer p;
+	struct service *s;
+	struct client *prev, *next;
+	// untagged requests waiting for their replies, oldest first
+	struct call *order;
+	struct call **order_tail;
+	// calls outstanding, the client is freed once closed and zero
+	int refs;
+	bool closed;
+	struct client *dead_next;
+};
+
+struct listener {
+	enum kind kind;
+	int fd;
+	struct service *s;
+};
+
+struct service {
+	struct listener l;
+	struct upstream *ups;
+	int upn;
+	struct client *clients;
+	// every upstream has a full backlog, clients aren't read
+	bool busy;
+};
+
+static int epfd;
+static struct peer *dirty;
+static struct client *dead;
+
+static void close_fds(const int *fds, int fdn)
+{
+	for (int i = 0; i < fdn; i++) {
+		close(fds[i]);
+	}
+}
+
+static void msg_free(struct msg *m)
+{
+	close_fds(m->fds, m->fdn);
+	free(m);
+}
+
+static void queue_init(struct queue *q)
+{
+	q->head = NULL;
+	q->tail = &q->head;
+	q->n = 0;
+}
+
+static void queue_push(struct queue *q, struct msg *m)
+{
+	m->next = NULL;
+	*q->tail = m;
+	q->tail = &m->next;
+	q->n++;
+}
+
+static void queue_clear(struct queue *q)
+{
+	while (q->head) {
+		struct msg *m = q->head;
+		q->head = m->next;
+		msg_free(m);
+	}
+	queue_init(q);
+}
+
+// a copy of a message with its header replaced, takes ownership of fds
+static struct msg *msg_new(const char *hdr, int hdrlen, const char *body,
+			   int bodylen, const int *fds, int fdn)
+{
+	struct msg *m = malloc(sizeof(*m) + hdrlen + bodylen);
+	if (!m) {
+		close_fds(fds, fdn);
+		return NULL;
+	}
+	m->len = hdrlen + bodylen;
+	memcpy(m->buf, hdr, hdrlen);
+	memcpy(m->buf + hdrlen, body, bodylen);
+	m->fdn = fdn;
+	memcpy(m->fds, fds, fdn * sizeof(*fds));
+	return m;
+}
+
+static void set_events(struct peer *p, unsigned events)
+{
+	if (p->events != events) {
+		struct epoll_event ev = { .events = events, .data.ptr = p };
+		epoll_ctl(epfd, EPOLL_CTL_MOD, p->fd, &ev);
+		p->events = events;
+	}
+}
+
+static void mark_dirty(struct peer *p)
+{
+	if (!p->dirty) {
+		p->dirty = true;
+		p->dnext = dirty;
+		dirty = p;
+	}
+}
+
+static void send_to(struct peer *p, struct msg *m)
+{
+	if (m) {
+		queue_push(&p->out, m);
+		mark_dirty(p);
+	}
+}
+
+///////////////////////////////
+// Clients
+
+static void client_events(struct client *c)
+{
+	bool paused = c->s->busy || c->p.out.n >= MAX_BACKLOG;
+	set_events(&c->p, (paused ? 0 : EPOLLIN) |
+				  (c->p.out.head ? EPOLLOUT : 0));
+}
+
+static void client_put(struct client *c)
+{
+	if (c->closed && !c->refs) {
+		// other events in this batch may still refer to it
+		c->dead_next = dead;
+		dead = c;
+	}
+}
+
+static void client_close(struct client *c)
+{
+	if (c->closed) {
+		return;
+	}
+	c->closed = true;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->p.fd, NULL);
+	close(c->p.fd);
+	queue_clear(&c->p.out);
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		c->s->clients = c->next;
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	}
+	client_put(c);
+}
+
+static void deliver(struct client *c, struct msg *m)
+{
+	if (c->closed) {
+		if (m) {
+			msg_free(m);
+		}
+	} else {
+		send_to(&c->p, m);
+	}
+}
+
+// passes on a reply, after the replies to earlier untagged requests
+static void reply(struct call *call, struct msg *m, bool final)
+{
+	struct client *c = call->c;
+	if (!call->tagged && call != c->order) {
+		if (m) {
+			queue_push(&call->held, m);
+		}
+		call->done = final;
+		return;
+	}
+	deliver(c, m);
+	if (!final) {
+		return;
+	} else if (call->tagged) {
+		free(call);
+		c->refs--;
+		client_put(c);
+		return;
+	}
+
+	for (;;) {
+		// release the replies held behind it
+		struct call *next = call->next;
+		c->order = next;
+		if (!next) {
+			c->order_tail = &c->order;
+		}
+		free(call);
+		c->refs--;
+		if (!next) {
+			break;
+		}
+		while (next->held.head) {
+			struct msg *h = next->held.head;
+			next->held.head = h->next;
+			deliver(c, h);
+		}
+		queue_init(&next->held);
+		if (!next->done) {
+			break;
+		}
+		call = next;
+	}
+	client_put(c);
+}
+
+static void reply_error(struct call *call, const char *code, const char *desc)
+{
+	char buf[256];
+	int hdr = call->tagged ? call->idlen : 0;
+	memcpy(buf, call->idline, hdr);
+	int n = sipc_format(buf + hdr, sizeof(buf) - hdr, "E %s %s\n", code,
+			    desc);
+	reply(call, msg_new(buf, hdr + n, NULL, 0, NULL, 0), true);
+}
+
+///////////////////////////////
+// Upstreams
+
+static struct call **tbl_find(struct upstream *u, uint64_t id)
+{
+	size_t i = id & u->mask;
+	while (u->tbl[i] && u->tbl[i]->id != id) {
+		i = (i + 1) & u->mask;
+	}
+	return &u->tbl[i];
+}
+
+static int tbl_insert(struct upstream *u, struct call *call)
+{
+	if ((u->used + 1) * 2 > u->mask + 1) {
+		struct call **old = u->tbl;
+		size_t oldn = u->mask + 1;
+		u->tbl = calloc(oldn * 2, sizeof(*u->tbl));
+		if (!u->tbl) {
+			u->tbl = old;
+			return -1;
+		}
+		u->mask = oldn * 2 - 1;
+		for (size_t i = 0; i < oldn; i++) {
+			if (old[i]) {
+				*tbl_find(u, old[i]->id) = old[i];
+			}
+		}
+		free(old);
+	}
+	*tbl_find(u, call->id) = call;
+	u->used++;
+	return 0;
+}
+
+static void tbl_remove(struct upstream *u, struct call **slot)
+{
+	// backward shift deletion keeps probe sequences unbroken
+	size_t i = slot - u->tbl;
+	size_t j = i;
+	for (;;) {
+		j = (j + 1) & u->mask;
+		if (!u->tbl[j]) {
+			break;
+		}
+		size_t home = u->tbl[j]->id & u->mask;
+		if (((j - home) & u->mask) >= ((j - i) & u->mask)) {
+			u->tbl[i] = u->tbl[j];
+			i = j;
+		}
+	}
+	u->tbl[i] = NULL;
+	u->used--;
+}
+
+static void upstream_connect(struct upstream *u)
+{
+	int fd = ipc_unix_connect(u->path);
+	if (fd < 0) {
+		return;
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &u->p };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		close(fd);
+		return;
+	}
+	u->p.fd = fd;
+	u->p.events = EPOLLIN;
+}
+
+static void upstream_fail(struct upstream *u)
+{
+	if (u->p.fd < 0) {
+		return;
+	}
+	fprintf(stderr, "c-proxy: lost %s\n", u->path);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, u->p.fd, NULL);
+	close(u->p.fd);
+	u->p.fd = -1;
+	queue_clear(&u->p.out);
+	for (size_t i = 0; i <= u->mask; i++) {
+		struct call *call = u->tbl[i];
+		if (call) {
+			u->tbl[i] = NULL;
+			reply_error(call, "unavailable", "upstream lost");
+		}
+	}
+	u->used = 0;
+}
+
+// the upstream with the least outstanding work
+static struct upstream *pick_upstream(struct service *s)
+{
+	struct upstream *best = NULL;
+	for (int i = 0; i < s->upn; i++) {
+		struct upstream *u = &s->ups[i];
+		if (u->p.fd >= 0 &&
+		    (!best || u->used + u->p.out.n < best->used + best->p.out.n)) {
+			best = u;
+		}
+	}
+	return best;
+}
+
+///////////////////////////////
+// Forwarding
+
+static void forward_request(struct client *c, const char *buf, int len,
+			    const int *fds, int fdn)
+{
+	const char *nl = memchr(buf, '\n', len);
+	struct call *call = calloc(1, sizeof(*call));
+	if (!nl || !call) {
+		// malformed, or out of memory which leaves the client out of
+		// sync
+		close_fds(fds, fdn);
+		free(call);
+		client_close(c);
+		return;
+	}
+	int hl = (int)(nl - buf) + 1;
+	call->c = c;
+	call->tagged = buf[0] == 'I';
+	queue_init(&call->held);
+	c->refs++;
+	if (call->tagged) {
+		if (hl > (int)sizeof(call->idline)) {
+			free(call);
+			c->refs--;
+			client_close(c);
+			return;
+		}
+		memcpy(call->idline, buf, hl);
+		call->idlen = hl;
+		buf += hl;
+		len -= hl;
+	} else {
+		*c->order_tail = call;
+		c->order_tail = &call->next;
+	}
+
+	struct upstream *u = pick_upstream(c->s);
+	if (!u) {
+		close_fds(fds, fdn);
+		reply_error(call, "unavailable", "no upstream connection");
+		return;
+	}
+	call->id = ++u->next_id;
+	if (tbl_insert(u, call)) {
+		close_fds(fds, fdn);
+		reply_error(call, "overloaded", "out of memory");
+		return;
+	}
+	char hdr[32];
+	int n = sipc_format(hdr, sizeof(hdr), "I %llu\n",
+			    (unsigned long long)call->id);
+	struct msg *m = msg_new(hdr, n, buf, len, fds, fdn);
+	if (!m) {
+		tbl_remove(u, tbl_find(u, call->id));
+		reply_error(call, "overloaded", "out of memory");
+		return;
+	}
+	send_to(&u->p, m);
+}
+
+static void forward_reply(struct upstream *u, const char *buf, int len,
+			  const int *fds, int fdn)
+{
+	sipc_parser_t p;
+	uint64_t id;
+	struct call **slot = NULL;
+	const char *nl = memchr(buf, '\n', len);
+	if (!sipc_init(&p, buf, len) && sipc_request_id(&p, &id) > 0) {
+		slot = tbl_find(u, id);
+	}
+	if (!slot || !*slot) {
+		// not ours, e.g. an event nobody subscribed to
+		close_fds(fds, fdn);
+		return;
+	}
+	struct call *call = *slot;
+	bool final = sipc_peek(&p) != SIPC_PART;
+	if (final) {
+		tbl_remove(u, slot);
+	}
+	int hl = (int)(nl - buf) + 1;
+	struct msg *m = msg_new(call->idline, call->tagged ? call->idlen : 0,
+				buf + hl, len - hl, fds, fdn);
+	reply(call, m, final);
+}
+
+///////////////////////////////
+// Batched I/O
+
+static char bufs[BATCH][BUFSZ];
+
+union control {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(MAX_FDS * sizeof(int))];
+};
+
+static int take_fds(struct msghdr *h, int *fds)
+{
+	int fdn = 0;
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(h); cm;
+	     cm = CMSG_NXTHDR(h, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SCM_RIGHTS) {
+			int cnt = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds + fdn, CMSG_DATA(cm), cnt * sizeof(int));
+			fdn += cnt;
+		}
+	}
+	return fdn;
+}
+
+// returns # of messages read, 0 on EAGAIN or -ve once the peer has gone
+static int read_batch(struct peer *p, void (*fn)(struct peer *p,
+						  const char *buf, int len,
+						  const int *fds, int fdn))
+{
+	static union control ctl[BATCH];
+	struct mmsghdr v[BATCH];
+	struct iovec iov[BATCH];
+	for (int i = 0; i < BATCH; i++) {
+		iov[i] = (struct iovec){ .iov_base = bufs[i], .iov_len = BUFSZ };
+		v[i].msg_hdr = (struct msghdr){
+			.msg_iov = &iov[i],
+			.msg_iovlen = 1,
+			.msg_control = ctl[i].buf,
+			.msg_controllen = sizeof(ctl[i].buf),
+		};
+	}
+	int n = recvmmsg(p->fd, v, BATCH, MSG_DONTWAIT | MSG_CMSG_CLOEXEC,
+			 NULL);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+		      errno == EINTR)) {
+		return 0;
+	} else if (n < 0) {
+		return -1;
+	}
+	for (int i = 0; i < n; i++) {
+		int fds[MAX_FDS];
+		int fdn = take_fds(&v[i].msg_hdr, fds);
+		if (!v[i].msg_len ||
+		    v[i].msg_hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+			// closed, or a message we can't pass on intact
+			close_fds(fds, fdn);
+			while (++i < n) {
+				close_fds(fds, take_fds(&v[i].msg_hdr, fds));
+			}
+			return -1;
+		}
+		fn(p, bufs[i], (int)v[i].msg_len, fds, fdn);
+	}
+	return n;
+}
+
+// returns zero on success or non-zero once the peer has gone
+static int flush(struct peer *p)
+{
+	static union control ctl[BATCH];
+	while (p->out.head) {
+		struct mmsghdr v[BATCH];
+		struct iovec iov[BATCH];
+		int n = 0;
+		for (struct msg *m = p->out.head; m && n < BATCH; m = m->next) {
+			iov[n] = (struct iovec){ .iov_base = m->buf,
+						 .iov_len = m->len };
+			v[n].msg_hdr = (struct msghdr){
+				.msg_iov = &iov[n],
+				.msg_iovlen = 1,
+			};
+			if (m->fdn) {
+				struct msghdr *h = &v[n].msg_hdr;
+				h->msg_control = ctl[n].buf;
+				h->msg_controllen =
+					CMSG_SPACE(m->fdn * sizeof(int));
+				struct cmsghdr *cm = CMSG_FIRSTHDR(h);
+				cm->cmsg_level = SOL_SOCKET;
+				cm->cmsg_type = SCM_RIGHTS;
+				cm->cmsg_len = CMSG_LEN(m->fdn * sizeof(int));
+				memcpy(CMSG_DATA(cm), m->fds,
+				       m->fdn * sizeof(int));
+			}
+			n++;
+		}
+		int sent = sendmmsg(p->fd, v, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		} else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else if (sent < 0) {
+			return -1;
+		}
+		for (int i = 0; i < sent; i++) {
+			struct msg *m = p->out.head;
+			p->out.head = m->next;
+			p->out.n--;
+			msg_free(m);
+		}
+		if (!p->out.head) {
+			p->out.tail = &p->out.head;
+		}
+		if (sent < n) {
+			break;
+		}
+	}
+	return 0;
+}
+
+static void on_request(struct peer *p, const char *buf, int len,
+		       const int *fds, int fdn)
+{
+	struct client *c = (struct client *)p;
+	if (c->closed) {
+		close_fds(fds, fdn);
+	} else {
+		forward_request(c, buf, len, fds, fdn);
+	}
+}
+
+static void on_reply(struct peer *p, const char *buf, int len, const int *fds,
+		     int fdn)
+{
+	forward_reply((struct upstream *)p, buf, len, fds, fdn);
+}
+
+static void flush_dirty(void)
+{
+	while (dirty) {
+		struct peer *p = dirty;
+		dirty = p->dnext;
+		p->dirty = false;
+		if (p->kind == UPSTREAM) {
+			struct upstream *u = (struct upstream *)p;
+			if (u->p.fd >= 0 && flush(p)) {
+				upstream_fail(u);
+			} else if (u->p.fd >= 0) {
+				set_events(p, EPOLLIN |
+						      (p->out.head ? EPOLLOUT :
+								     0));
+			}
+		} else {
+			struct client *c = (struct client *)p;
+			if (c->closed) {
+				continue;
+			} else if (flush(p)) {
+				client_close(c);
+			} else {
+				client_events(c);
+			}
+		}
+	}
+}
+
+// stops reading from clients while none of the upstreams can take more
+static void update_busy(struct service *s)
+{
+	bool busy = true;
+	for (int i = 0; i < s->upn; i++) {
+		struct upstream *u = &s->ups[i];
+		busy = busy && u->p.fd >= 0 && u->p.out.n >= MAX_BACKLOG;
+	}
+	if (busy != s->busy) {
+		s->busy = busy;
+		for (struct client *c = s->clients; c != NULL; c = c->next) {
+			client_events(c);
+		}
+	}
+}
+
+static void accept_clients(struct service *s)
+{
+	for (int i = 0; i < BATCH; i++) {
+		int fd = accept4(s->l.fd, NULL, NULL,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			return;
+		}
+		struct client *c = calloc(1, sizeof(*c));
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+		if (!c || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		c->p.kind = CLIENT;
+		c->p.fd = fd;
+		c->p.events = EPOLLIN;
+		queue_init(&c->p.out);
+		c->s = s;
+		c->order_tail = &c->order;
+		c->next = s->clients;
+		if (s->clients) {
+			s->clients->prev = c;
+		}
+		s->clients = c;
+		client_events(c);
+	}
+}
+
+static void handle_event(struct epoll_event *ev)
+{
+	enum kind *kind = ev->data.ptr;
+	if (*kind == LISTENER) {
+		accept_clients(((struct listener *)kind)->s);
+	} else if (*kind == CLIENT) {
+		struct client *c = ev->data.ptr;
+		if (!c->closed && ev->events & EPOLLOUT) {
+			mark_dirty(&c->p);
+		}
+		if (!c->closed && ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR) &&
+		    read_batch(&c->p, on_request) < 0) {
+			client_close(c);
+		}
+	} else {
+		struct upstream *u = ev->data.ptr;
+		if (u->p.fd >= 0 && ev->events & EPOLLOUT) {
+			mark_dirty(&u->p);
+		}
+		if (u->p.fd >= 0 && ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR) &&
+		    read_batch(&u->p, on_reply) < 0) {
+			upstream_fail(u);
+		}
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int usage(void)
+{
+	fprintf(stderr,
+		"usage: c-proxy [-conns n] <listen path> <upstream path> "
+		"[<listen path> <upstream path>]...\n");
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int conns = 2;
+	int i = 1;
+	if (i + 1 < argc && !strcmp(argv[i], "-conns")) {
+		conns = atoi(argv[i + 1]);
+		i += 2;
+	}
+	if (conns < 1 || i >= argc || (argc - i) % 2) {
+		return usage();
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	int servicen = (argc - i) / 2;
+	struct service *services = calloc(servicen, sizeof(*services));
+	if (epfd < 0 || !services) {
+		perror("c-proxy");
+		return 2;
+	}
+	for (int n = 0; n < servicen; n++, i += 2) {
+		struct service *s = &services[n];
+		s->l.kind = LISTENER;
+		s->l.s = s;
+		s->l.fd = ipc_unix_listen(argv[i]);
+		s->upn = conns;
+		s->ups = calloc(conns, sizeof(*s->ups));
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &s->l };
+		if (s->l.fd < 0 || !s->ups ||
+		    fcntl(s->l.fd, F_SETFL, O_NONBLOCK) ||
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, s->l.fd, &ev)) {
+			perror(argv[i]);
+			return 2;
+		}
+		for (int k = 0; k < conns; k++) {
+			struct upstream *u = &s->ups[k];
+			u->p.kind = UPSTREAM;
+			u->p.fd = -1;
+			queue_init(&u->p.out);
+			u->s = s;
+			u->path = argv[i + 1];
+			u->mask = 63;
+			u->tbl = calloc(u->mask + 1, sizeof(*u->tbl));
+			if (!u->tbl) {
+				perror("c-proxy");
+				return 2;
+			}
+			upstream_connect(u);
+		}
+	}
+
+	double retry = now() + RETRY_MS / 1e3;
+	for (;;) {
+		bool down = false;
+		for (int n = 0; n < servicen; n++) {
+			for (int k = 0; k < services[n].upn; k++) {
+				down = down || services[n].ups[k].p.fd < 0;
+			}
+		}
+		struct epoll_event evs[EVENT_BATCH];
+		int n = epoll_wait(epfd, evs, EVENT_BATCH, down ? RETRY_MS : -1);
+		for (int k = 0; k < n; k++) {
+			handle_event(&evs[k]);
+		}
+		flush_dirty();
+
+		if (down && now() >= retry) {
+			retry = now() + RETRY_MS / 1e3;
+			for (int s = 0; s < servicen; s++) {
+				for (int k = 0; k < services[s].upn; k++) {
+					if (services[s].ups[k].p.fd < 0) {
+						upstream_connect(
+							&services[s].ups[k]);
+					}
+				}
+			}
+		}
+		for (int s = 0; s < servicen; s++) {
+			update_busy(&services[s]);
+		}
+		while (dead) {
+			struct client *c = dead;
+			dead = c->dead_next;
+			free(c);
+		}
+	}
+}
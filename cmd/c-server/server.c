@@ -2,7 +2,9 @@
 #include "ipc.h"
 #include "ipc-unix.h"
 #include "ipc-windows.h"
+#include "ipc-server.h"
 #include <string.h>
+#include <stdlib.h>
 
 #ifdef _MSC_VER
 #include <tinycthread.h>
@@ -13,10 +15,10 @@
 #include <sys/socket.h>
 #endif
 
+#ifdef _WIN32
 static int handler_thread(void *arg)
 {
 	fprintf(stderr, "in thread\n");
-#ifdef _WIN32
 	void *pipe = arg;
 	DWORD read;
 	char buf[4096];
@@ -51,37 +53,59 @@ static int handler_thread(void *arg)
 		}
 	}
 	CloseHandle(pipe);
+	return 0;
+}
 #else
+static void cmd_handler(void *udata, struct ipc_request *r,
+			sipc_parser_t *args)
+{
+	fprintf(stderr, "cmd\n");
+	print_args(args);
+	int fd = ipc_request_fd(r, 0);
+	if (fd >= 0) {
+		fprintf(stderr, "have fd %d\n", fd);
+		struct timespec duration = {
+			.tv_sec = 4,
+		};
+		thrd_sleep(&duration, NULL);
+		write(fd, "hello", 5);
+		close(fd);
+	}
+	ipc_reply(r, "S\n");
+}
+
+static int notify_thread(void *arg)
+{
 	int fd = (int)(uintptr_t)arg;
+	static char bufs[16][4096];
+	struct ipc_dgram v[16];
+	for (int i = 0; i < 16; i++) {
+		v[i].buf = bufs[i];
+		v[i].cap = sizeof(bufs[i]);
+	}
 	for (;;) {
-		int fds[1], fdn = 1;
-		char buf[4096];
-		int r = ipc_unix_recvmsg(fd, buf, sizeof(buf), fds, &fdn);
-		if (r <= 0) {
+		int n = ipc_dgram_recv(fd, v, 16);
+		if (n < 0) {
+			perror("notify");
 			break;
 		}
-		if (fdn) {
-			fprintf(stderr, "have fd %d\n", fds[0]);
-			struct timespec duration = {
-				.tv_sec = 4,
-			};
-			thrd_sleep(&duration, NULL);
-			write(fds[0], "hello", 5);
-			close(fds[0]);
-		}
-		sipc_parser_t p;
-		if (sipc_init(&p, buf, r)) {
-			fprintf(stderr, "failed to parse message\n");
-			continue;
+		for (int i = 0; i < n; i++) {
+			sipc_unframer_t u;
+			sipc_parser_t p;
+			sipc_unframe_init(&u, v[i].buf, v[i].len);
+			while (sipc_unframe_next(&u, &p) > 0) {
+				fprintf(stderr, "notify from pid %d uid %d\n",
+					v[i].pid, v[i].uid);
+				print_message(&p);
+			}
 		}
-		print_message(&p);
 	}
 	close(fd);
-#endif
 	return 0;
 }
+#endif
 
-int main()
+int main(int argc, char *argv[])
 {
 #ifdef _WIN32
 	for (;;) {
@@ -101,26 +125,60 @@ int main()
 		thrd_detach(thread);
 	}
 #else
-	int fd = ipc_unix_listen("sock");
-	if (fd < 0) {
-		perror("listen");
-		return 2;
+	int nfd = ipc_unix_dgram_listen("sock.notify", true);
+	thrd_t nthread;
+	if (nfd < 0) {
+		perror("listen notify");
+	} else if (thrd_create(&nthread, &notify_thread,
+			       (void *)(uintptr_t)nfd) == thrd_success) {
+		thrd_detach(nthread);
 	}
 
-	for (;;) {
-		int cfd = accept(fd, NULL, NULL);
-		if (cfd < 0) {
-			perror("accept");
-			break;
+	// a restarted server takes over from this one
+	struct ipc_server_config cfg = { .io_threads = 1, .handover = true };
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (!strcmp(argv[i], "-spin")) {
+			cfg.spin_ns = atol(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-cpu")) {
+			cfg.pin = true;
+			cfg.first_cpu = atoi(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-io")) {
+			cfg.io_threads = atoi(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-workers")) {
+			cfg.workers = atoi(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-iocpus")) {
+			cfg.io_cpus = argv[i + 1];
+		} else if (!strcmp(argv[i], "-workercpus")) {
+			cfg.worker_cpus = argv[i + 1];
+		} else if (!strcmp(argv[i], "-maxinflight")) {
+			cfg.max_inflight = atoi(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-maxqueued")) {
+			cfg.max_queued = atoi(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-rate")) {
+			cfg.rate = atof(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-slow")) {
+			// log requests slower than this many ns
+			cfg.slow_ns = atol(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-slowlog")) {
+			cfg.slow_log = argv[i + 1];
+		} else if (!strcmp(argv[i], "-percore")) {
+			// thread-per-core with this many cores
+			cfg.per_core = true;
+			cfg.io_threads = atoi(argv[i + 1]);
+			cfg.balance = IPC_LEAST_LOADED;
 		}
-		thrd_t thread;
-		if (thrd_create(&thread, &handler_thread,
-				(void *)(uintptr_t)cfd) != thrd_success) {
-			perror("thread");
-			break;
-		}
-		thrd_detach(thread);
 	}
+
+	struct ipc_server *srv = ipc_server_new(&cfg);
+	if (!srv || ipc_server_handle(srv, "cmd", &cmd_handler, NULL) ||
+	    ipc_server_start_path(srv, "sock")) {
+		perror("server");
+		return 2;
+	}
+	ipc_server_wait(srv);
+	fprintf(stderr, "handed over\n");
+	ipc_server_stop(srv);
+	ipc_server_free(srv);
 #endif
 	return 0;
 }
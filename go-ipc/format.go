@@ -16,6 +16,9 @@ const (
 	ErrorEntry         EntryType = 'E'
 	SuccessEntry       EntryType = 'S'
 	WindowsHandleEntry EntryType = 'W'
+	RequestIDEntry     EntryType = 'I'
+	DeadlineEntry      EntryType = 'D'
+	PartEntry          EntryType = 'P'
 )
 
 const hexChars = "0123456789abcdef"
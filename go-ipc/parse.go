@@ -5,6 +5,7 @@ import (
 	"io"
 	"math"
 	"math/bits"
+	"time"
 )
 
 var ErrInvalid = errors.New("invalid input")
@@ -354,6 +355,51 @@ func (p *Parser) NextEntry() EntryType {
 	return EntryType(p.peek())
 }
 
+// RequestID parses an optional leading request ID entry. Replies to a tagged
+// request carry the same ID so that they can be sent out of order.
+func (p *Parser) RequestID() (id uint64, ok bool, err error) {
+	if p.NextEntry() != RequestIDEntry {
+		return 0, false, nil
+	}
+	vals, err := p.ParseEntry()
+	if err != nil {
+		return 0, false, err
+	} else if len(vals) != 1 {
+		return 0, false, ErrInvalid
+	}
+	id, ok = vals[0].(uint64)
+	if !ok {
+		return 0, false, ErrInvalid
+	}
+	return id, true, nil
+}
+
+// Deadline parses an optional deadline entry following the request ID. The
+// deadline is relative to when the request was sent.
+func (p *Parser) Deadline() (d time.Duration, ok bool, err error) {
+	if p.NextEntry() != DeadlineEntry {
+		return 0, false, nil
+	}
+	vals, err := p.ParseEntry()
+	if err != nil {
+		return 0, false, err
+	} else if len(vals) != 1 {
+		return 0, false, ErrInvalid
+	}
+	var secs float64
+	switch v := vals[0].(type) {
+	case uint64:
+		secs = float64(v)
+	case int64:
+		secs = float64(v)
+	case float64:
+		secs = v
+	default:
+		return 0, false, ErrInvalid
+	}
+	return time.Duration(secs * float64(time.Second)), true, nil
+}
+
 func (p *Parser) ParseEntry() ([]interface{}, error) {
 	p.skip(1) // entry type
 	ret := []interface{}{}
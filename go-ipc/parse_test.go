@@ -3,6 +3,7 @@ package ipc
 import (
 	"reflect"
 	"testing"
+	"time"
 )
 
 func TestParse(t *testing.T) {
@@ -45,3 +46,36 @@ func TestParse(t *testing.T) {
 		}
 	}
 }
+
+func TestRequestID(t *testing.T) {
+	p, err := NewParser([]byte("I 2a\nS 2:ok\n"))
+	if err != nil {
+		t.Fatalf("unexpected error %v", err)
+	}
+	id, ok, err := p.RequestID()
+	if err != nil || !ok || id != 0x2a {
+		t.Errorf("expected id 0x2a, got %v %v %v", id, ok, err)
+	}
+	if typ := p.NextEntry(); typ != SuccessEntry {
+		t.Errorf("expected success entry, got %d", typ)
+	}
+
+	p, _ = NewParser([]byte("R 4:ping\n"))
+	if _, ok, err := p.RequestID(); ok || err != nil {
+		t.Errorf("expected untagged message, got %v %v", ok, err)
+	}
+}
+
+func TestDeadline(t *testing.T) {
+	p, err := NewParser([]byte("D 1p-1\nR 4:ping\n"))
+	if err != nil {
+		t.Fatalf("unexpected error %v", err)
+	}
+	d, ok, err := p.Deadline()
+	if err != nil || !ok || d != 500*time.Millisecond {
+		t.Errorf("expected 500ms deadline, got %v %v %v", d, ok, err)
+	}
+	if typ := p.NextEntry(); typ != RequestEntry {
+		t.Errorf("expected request entry, got %d", typ)
+	}
+}
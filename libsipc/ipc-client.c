@@ -0,0 +1,1125 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#include "ipc-client.h"
+#include "ipc-hist.h"
+#include "ipc-server.h"
+#include "ipc-unix.h"
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#define POOL_BUFSZ 65536
+// call latency histogram for hedging, four buckets per power of two ns
+#define HIST_BUCKETS 256
+// calls between recomputing the hedge delay
+#define HEDGE_RECALC 128
+// samples kept before the histogram is aged by halving it
+#define HEDGE_WINDOW 8192
+
+struct pool_endpoint;
+
+struct pool_conn {
+	struct pool_conn *next;
+	struct pool_endpoint *ep;
+	int fd;
+	char buf[POOL_BUFSZ];
+};
+
+struct pool_endpoint {
+	char *path;
+	mtx_t lk;
+	struct pool_conn *idle;
+	int idlen;
+	atomic_int outstanding;
+	atomic_bool down;
+};
+
+struct ipc_pool {
+	struct pool_endpoint *eps;
+	int epn;
+	int warm;
+	int retry_ms;
+	bool tagged;
+	long spin_ns;
+	atomic_ulong spin_hits;
+	atomic_ulong spin_misses;
+	atomic_ullong spin_total_ns;
+	atomic_uint next;
+	atomic_ullong next_id;
+	double hedge_percentile;
+	double hedge_budget;
+	atomic_ulong calls;
+	atomic_ulong hedges;
+	atomic_ulong hedge_wins;
+	// zero until there are enough samples
+	atomic_llong hedge_ns;
+	atomic_uint samples;
+	atomic_uint hist[HIST_BUCKETS];
+	mtx_t lk;
+	cnd_t wake;
+	bool stop;
+	thrd_t thread;
+};
+
+static struct pool_conn *new_conn(struct pool_endpoint *ep)
+{
+	int fd = ipc_unix_connect(ep->path);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct pool_conn *c = malloc(sizeof(*c));
+	if (!c) {
+		close(fd);
+		return NULL;
+	}
+	c->next = NULL;
+	c->ep = ep;
+	c->fd = fd;
+	return c;
+}
+
+static void free_conn(struct pool_conn *c)
+{
+	close(c->fd);
+	free(c);
+}
+
+static void wake_reconnect(struct ipc_pool *p)
+{
+	mtx_lock(&p->lk);
+	cnd_signal(&p->wake);
+	mtx_unlock(&p->lk);
+}
+
+static void checkin(struct ipc_pool *p, struct pool_conn *c)
+{
+	struct pool_endpoint *ep = c->ep;
+	mtx_lock(&ep->lk);
+	if (ep->idlen < p->warm) {
+		c->next = ep->idle;
+		ep->idle = c;
+		ep->idlen++;
+		c = NULL;
+	}
+	mtx_unlock(&ep->lk);
+	if (c) {
+		// extra connection opened for a burst
+		free_conn(c);
+	}
+}
+
+static struct pool_conn *checkout(struct ipc_pool *p, struct pool_endpoint *ep)
+{
+	mtx_lock(&ep->lk);
+	struct pool_conn *c = ep->idle;
+	if (c) {
+		ep->idle = c->next;
+		ep->idlen--;
+	}
+	mtx_unlock(&ep->lk);
+
+	if (!c) {
+		c = new_conn(ep);
+	}
+	if (!c) {
+		atomic_store(&ep->down, true);
+		wake_reconnect(p);
+	}
+	return c;
+}
+
+static void conn_failed(struct ipc_pool *p, struct pool_conn *c)
+{
+	// The idle connections to this endpoint are most likely dead too
+	// (e.g. the replica restarted). Drop them all and leave the
+	// reconnect thread to build the pool back up.
+	struct pool_endpoint *ep = c->ep;
+	mtx_lock(&ep->lk);
+	struct pool_conn *idle = ep->idle;
+	ep->idle = NULL;
+	ep->idlen = 0;
+	mtx_unlock(&ep->lk);
+
+	free_conn(c);
+	while (idle) {
+		struct pool_conn *next = idle->next;
+		free_conn(idle);
+		idle = next;
+	}
+
+	atomic_store(&ep->down, true);
+	wake_reconnect(p);
+}
+
+static void top_up(struct ipc_pool *p, struct pool_endpoint *ep)
+{
+	mtx_lock(&ep->lk);
+	int need = p->warm - ep->idlen;
+	mtx_unlock(&ep->lk);
+
+	while (need-- > 0) {
+		struct pool_conn *c = new_conn(ep);
+		if (!c) {
+			atomic_store(&ep->down, true);
+			return;
+		}
+		atomic_store(&ep->down, false);
+		checkin(p, c);
+	}
+}
+
+static int reconnect_thread(void *arg)
+{
+	struct ipc_pool *p = arg;
+	mtx_lock(&p->lk);
+	while (!p->stop) {
+		mtx_unlock(&p->lk);
+		for (int i = 0; i < p->epn; i++) {
+			top_up(p, &p->eps[i]);
+		}
+		mtx_lock(&p->lk);
+
+		if (!p->stop) {
+			struct timespec ts;
+			timespec_get(&ts, TIME_UTC);
+			ts.tv_nsec += (long)p->retry_ms * 1000000;
+			ts.tv_sec += ts.tv_nsec / 1000000000;
+			ts.tv_nsec %= 1000000000;
+			cnd_timedwait(&p->wake, &p->lk, &ts);
+		}
+	}
+	mtx_unlock(&p->lk);
+	return 0;
+}
+
+// picks the replica with the least outstanding requests, preferring those
+// that are up
+static struct pool_endpoint *pick(struct ipc_pool *p,
+				  struct pool_endpoint *skip)
+{
+	unsigned start = atomic_fetch_add(&p->next, 1);
+	struct pool_endpoint *best = NULL;
+	int bestn = INT_MAX;
+	bool bestdown = true;
+	for (int i = 0; i < p->epn; i++) {
+		struct pool_endpoint *ep = &p->eps[(start + i) % p->epn];
+		if (ep == skip) {
+			continue;
+		}
+		bool down = atomic_load(&ep->down);
+		int n = atomic_load(&ep->outstanding);
+		if ((bestdown && !down) || (down == bestdown && n < bestn)) {
+			best = ep;
+			bestn = n;
+			bestdown = down;
+		}
+	}
+	return best;
+}
+
+// returns 1 if buf holds the reply to request id (0 if untagged), 0 if it
+// should be skipped or -ve if it is malformed
+static int check_reply(sipc_parser_t *reply, const char *buf, int n,
+		       unsigned long long id)
+{
+	if (sipc_init(reply, buf, n)) {
+		return -1;
+	}
+	uint64_t got;
+	int tagged = sipc_request_id(reply, &got);
+	if (tagged < 0) {
+		return -1;
+	} else if (tagged && id && got != id) {
+		// stale reply to an earlier request - drop it
+		return 0;
+	} else if (sipc_peek(reply) == SIPC_PART) {
+		// partial results are only delivered by ipc_client
+		return 0;
+	}
+	return 1;
+}
+
+// receives the reply to request id (0 if untagged)
+// returns # of bytes in the reply, 0 if the connection failed
+// or -ve if the reply is malformed
+static int recv_reply(struct ipc_pool *p, struct pool_conn *c,
+		      sipc_parser_t *reply, unsigned long long id)
+{
+	for (;;) {
+		struct ipc_spin s = { .budget_ns = p->spin_ns };
+		int r = ipc_unix_recvmsg_spin(c->fd, c->buf, POOL_BUFSZ, NULL,
+					      NULL, &s);
+		if (s.budget_ns) {
+			atomic_fetch_add(&p->spin_hits, s.hits);
+			atomic_fetch_add(&p->spin_misses, s.misses);
+			atomic_fetch_add(&p->spin_total_ns, s.spin_ns);
+		}
+		if (r <= 0) {
+			return 0;
+		}
+		int ok = check_reply(reply, c->buf, r, id);
+		if (ok) {
+			return ok < 0 ? -1 : r;
+		}
+	}
+}
+
+///////////////////////////////
+// Hedging
+
+static long long monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Adds a call latency and every HEDGE_RECALC calls recomputes the hedge
+// delay. Counters are updated without a lock so the percentile is only
+// approximate, which is all hedging needs.
+static void record_latency(struct ipc_pool *p, long long ns)
+{
+	atomic_fetch_add_explicit(&p->hist[ipc_hist_bucket(ns, HIST_BUCKETS)], 1,
+				  memory_order_relaxed);
+	unsigned n = atomic_fetch_add(&p->samples, 1) + 1;
+	if (n % HEDGE_RECALC) {
+		return;
+	}
+	unsigned counts[HIST_BUCKETS];
+	unsigned long total = 0;
+	bool age = n >= HEDGE_WINDOW;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		counts[i] = age ? atomic_fetch_sub(&p->hist[i],
+						   atomic_load(&p->hist[i]) / 2) :
+				  atomic_load(&p->hist[i]);
+		total += counts[i];
+	}
+	if (age) {
+		atomic_store(&p->samples, HEDGE_WINDOW / 2);
+	}
+	unsigned long want =
+		(unsigned long)(total * p->hedge_percentile / 100.0);
+	unsigned long seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += counts[i];
+		if (seen > want) {
+			atomic_store(&p->hedge_ns, ipc_hist_upper(i));
+			return;
+		}
+	}
+}
+
+// takes a hedge from the budget
+static bool hedge_admit(struct ipc_pool *p)
+{
+	unsigned long calls = atomic_load(&p->calls);
+	unsigned long hedges = atomic_load(&p->hedges);
+	do {
+		if (hedges + 1 > p->hedge_budget * calls) {
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak(&p->hedges, &hedges,
+					       hedges + 1));
+	return true;
+}
+
+// waits up to ns for any of the connections to become readable, forever if
+// ns is -ve
+// returns the number of readable connections, zero on timeout
+static int wait_readable(struct pollfd *pfd, int n, long long ns)
+{
+#ifdef __linux__
+	struct timespec ts = { .tv_sec = ns / 1000000000,
+			       .tv_nsec = ns % 1000000000 };
+	int r = ppoll(pfd, n, ns < 0 ? NULL : &ts, NULL);
+#else
+	int r = poll(pfd, n, ns < 0 ? -1 : (int)((ns + 999999) / 1000000));
+#endif
+	return r < 0 && errno == EINTR ? 0 : r;
+}
+
+// receives any reply already waiting, like recv_reply
+// returns -2 if there is none yet
+static int poll_reply(struct pool_conn *c, sipc_parser_t *reply,
+		      unsigned long long id)
+{
+	for (;;) {
+		int r = (int)recv(c->fd, c->buf, POOL_BUFSZ, MSG_DONTWAIT);
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return -2;
+		} else if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r <= 0) {
+			return 0;
+		}
+		int ok = check_reply(reply, c->buf, r, id);
+		if (ok) {
+			return ok < 0 ? -1 : r;
+		}
+	}
+}
+
+// Sends the request to a second replica once the first has taken longer
+// than the hedge delay and takes whichever reply arrives first. The other
+// connection is returned to the pool, where its late reply is dropped as
+// stale, and *pc is set to the one the reply was received on.
+// same return values as recv_reply
+static int recv_hedged(struct ipc_pool *p, struct pool_conn **pc,
+		       sipc_parser_t *reply, unsigned long long id,
+		       const char *fmt, va_list ap)
+{
+	struct pool_conn *c[2] = { *pc, NULL };
+	unsigned long long ids[2] = { id, 0 };
+	struct pollfd pfd[2] = { { .fd = c[0]->fd, .events = POLLIN } };
+
+	long long delay = atomic_load(&p->hedge_ns);
+	long long until = monotonic_ns() + delay;
+	for (long long left = delay; left > 0; left = until - monotonic_ns()) {
+		if (wait_readable(pfd, 1, left) > 0) {
+			int r = poll_reply(c[0], reply, id);
+			if (r != -2) {
+				return r;
+			}
+		}
+	}
+
+	struct pool_endpoint *ep = pick(p, c[0]->ep);
+	if (!ep || atomic_load(&ep->down) || !hedge_admit(p)) {
+		return recv_reply(p, c[0], reply, id);
+	}
+	atomic_fetch_add(&ep->outstanding, 1);
+	c[1] = checkout(p, ep);
+	int n = -1;
+	if (c[1]) {
+		ids[1] = atomic_fetch_add(&p->next_id, 1);
+		n = sipc_format(c[1]->buf, POOL_BUFSZ, "I %llu\n", ids[1]);
+		int m = sipc_vformat(c[1]->buf + n, POOL_BUFSZ - n, fmt, ap);
+		n = m < 0 || n + m >= POOL_BUFSZ ? -1 : n + m;
+	}
+	if (n < 0 || ipc_unix_sendmsg(c[1]->fd, c[1]->buf, n, NULL, 0) != n) {
+		if (c[1]) {
+			conn_failed(p, c[1]);
+		}
+		atomic_fetch_sub(&ep->outstanding, 1);
+		return recv_reply(p, c[0], reply, id);
+	}
+	pfd[1].fd = c[1]->fd;
+	pfd[1].events = POLLIN;
+
+	// a connection that fails drops out and the other is waited on alone
+	int live = 2;
+	int r = 0;
+	int won = 0;
+	while (live) {
+		wait_readable(pfd, 2, -1);
+		for (int i = 0; i < 2; i++) {
+			if (pfd[i].fd < 0 || !pfd[i].revents) {
+				continue;
+			}
+			r = poll_reply(c[i], reply, ids[i]);
+			if (r == 0 && --live) {
+				pfd[i].fd = -1;
+			} else if (r != -2) {
+				won = i;
+				goto done;
+			}
+		}
+	}
+done:
+	atomic_fetch_sub(&ep->outstanding, 1);
+	if (won) {
+		atomic_fetch_add(&p->hedge_wins, 1);
+	}
+	struct pool_conn *other = c[!won];
+	if (pfd[!won].fd < 0) {
+		conn_failed(p, other);
+	} else {
+		checkin(p, other);
+	}
+	*pc = c[won];
+	return r;
+}
+
+struct ipc_pool *ipc_pool_new(const struct ipc_pool_config *cfg)
+{
+	if (cfg->pathn <= 0) {
+		return NULL;
+	}
+	struct ipc_pool *p = calloc(1, sizeof(*p));
+	if (!p) {
+		return NULL;
+	}
+	p->eps = calloc(cfg->pathn, sizeof(*p->eps));
+	if (!p->eps) {
+		free(p);
+		return NULL;
+	}
+	p->epn = cfg->pathn;
+	for (int i = 0; i < p->epn; i++) {
+		p->eps[i].path = strdup(cfg->paths[i]);
+		if (!p->eps[i].path) {
+			while (i--) {
+				free(p->eps[i].path);
+			}
+			free(p->eps);
+			free(p);
+			return NULL;
+		}
+	}
+	p->warm = cfg->warm > 0 ? cfg->warm : 1;
+	p->retry_ms = cfg->retry_ms > 0 ? cfg->retry_ms : 100;
+	p->tagged = cfg->tagged;
+	p->spin_ns = cfg->spin_ns;
+	p->hedge_percentile = cfg->hedge_percentile;
+	p->hedge_budget = cfg->hedge_budget > 0 ? cfg->hedge_budget : 0.05;
+	atomic_init(&p->next_id, 1);
+	atomic_init(&p->calls, 0);
+	atomic_init(&p->hedges, 0);
+	atomic_init(&p->hedge_wins, 0);
+	atomic_init(&p->hedge_ns, 0);
+	atomic_init(&p->samples, 0);
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		atomic_init(&p->hist[i], 0);
+	}
+	mtx_init(&p->lk, mtx_plain);
+	cnd_init(&p->wake);
+
+	for (int i = 0; i < p->epn; i++) {
+		struct pool_endpoint *ep = &p->eps[i];
+		mtx_init(&ep->lk, mtx_plain);
+		atomic_init(&ep->outstanding, 0);
+		atomic_init(&ep->down, false);
+		top_up(p, ep);
+	}
+
+	if (thrd_create(&p->thread, &reconnect_thread, p) != thrd_success) {
+		p->stop = true;
+		ipc_pool_free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void ipc_pool_free(struct ipc_pool *p)
+{
+	if (!p) {
+		return;
+	}
+	mtx_lock(&p->lk);
+	bool running = !p->stop;
+	p->stop = true;
+	cnd_signal(&p->wake);
+	mtx_unlock(&p->lk);
+	if (running) {
+		thrd_join(p->thread, NULL);
+	}
+
+	for (int i = 0; i < p->epn; i++) {
+		struct pool_endpoint *ep = &p->eps[i];
+		while (ep->idle) {
+			struct pool_conn *next = ep->idle->next;
+			free_conn(ep->idle);
+			ep->idle = next;
+		}
+		mtx_destroy(&ep->lk);
+		free(ep->path);
+	}
+	cnd_destroy(&p->wake);
+	mtx_destroy(&p->lk);
+	free(p->eps);
+	free(p);
+}
+
+int ipc_pool_vcall(struct ipc_pool *p, ipc_call_t *call, const int *fds,
+		   int fdn, const char *fmt, va_list ap)
+{
+	struct pool_endpoint *skip = NULL;
+
+	// a request that could not be sent is retried once on another replica
+	for (int attempt = 0; attempt < 2; attempt++) {
+		struct pool_endpoint *ep = pick(p, skip);
+		if (!ep) {
+			return -1;
+		}
+		skip = ep;
+
+		atomic_fetch_add(&ep->outstanding, 1);
+		struct pool_conn *c = checkout(p, ep);
+		if (!c) {
+			atomic_fetch_sub(&ep->outstanding, 1);
+			continue;
+		}
+
+		int n = 0;
+		unsigned long long id = 0;
+		if (p->tagged) {
+			id = atomic_fetch_add(&p->next_id, 1);
+			n = sipc_format(c->buf, POOL_BUFSZ, "I %llu\n", id);
+		}
+
+		va_list aq;
+		va_copy(aq, ap);
+		int m = sipc_vformat(c->buf + n, POOL_BUFSZ - n, fmt, aq);
+		va_end(aq);
+		n += m;
+		if (m < 0 || n >= POOL_BUFSZ) {
+			atomic_fetch_sub(&ep->outstanding, 1);
+			checkin(p, c);
+			return -1;
+		}
+
+		long long start = p->hedge_percentile > 0 ? monotonic_ns() : 0;
+		if (ipc_unix_sendmsg(c->fd, c->buf, n, fds, fdn) != n) {
+			atomic_fetch_sub(&ep->outstanding, 1);
+			conn_failed(p, c);
+			continue;
+		}
+
+		int r;
+		if (start && p->tagged && !fdn && p->epn > 1 &&
+		    atomic_load(&p->hedge_ns)) {
+			atomic_fetch_add(&p->calls, 1);
+			va_list aq;
+			va_copy(aq, ap);
+			r = recv_hedged(p, &c, &call->reply, id, fmt, aq);
+			va_end(aq);
+		} else {
+			if (start) {
+				atomic_fetch_add(&p->calls, 1);
+			}
+			r = recv_reply(p, c, &call->reply, id);
+		}
+		if (start && r > 0) {
+			record_latency(p, monotonic_ns() - start);
+		}
+		atomic_fetch_sub(&ep->outstanding, 1);
+		if (r == 0) {
+			conn_failed(p, c);
+			return -1;
+		} else if (r < 0) {
+			checkin(p, c);
+			return -1;
+		}
+		call->conn = c;
+		return r;
+	}
+	return -1;
+}
+
+int ipc_pool_call(struct ipc_pool *p, ipc_call_t *c, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = ipc_pool_vcall(p, c, NULL, 0, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+void ipc_pool_done(struct ipc_pool *p, ipc_call_t *c)
+{
+	checkin(p, c->conn);
+	c->conn = NULL;
+}
+
+void ipc_pool_hedge_stats(struct ipc_pool *p, struct ipc_hedge_stats *s)
+{
+	s->calls = atomic_load(&p->calls);
+	s->hedges = atomic_load(&p->hedges);
+	s->wins = atomic_load(&p->hedge_wins);
+	s->delay_ns = atomic_load(&p->hedge_ns);
+}
+
+void ipc_pool_spin_stats(struct ipc_pool *p, struct ipc_spin *s)
+{
+	s->budget_ns = p->spin_ns;
+	s->hits = atomic_load(&p->spin_hits);
+	s->misses = atomic_load(&p->spin_misses);
+	s->spin_ns = atomic_load(&p->spin_total_ns);
+}
+
+#ifdef __linux__
+#define CLIENT_BUFSZ 65536
+#define CLIENT_MAX_FDS 16
+// sipc_vformat needs some slack past the end of the formatted message
+#define FORMAT_SLACK 32
+
+struct submission {
+	struct submission *next;
+	ipc_reply_fn part;
+	ipc_reply_fn cb;
+	void *udata;
+	uint64_t id;
+	int len;
+	int fdn;
+	int fds[CLIENT_MAX_FDS];
+	char buf[];
+};
+
+struct inflight {
+	uint64_t id;
+	ipc_reply_fn part;
+	ipc_reply_fn cb;
+	void *udata;
+};
+
+struct ipc_client {
+	int fd;
+	// in-process connection used instead of fd, see ipc_client_local
+	struct ipc_local *local;
+	int efd;
+	int epfd;
+	atomic_bool failed;
+	atomic_ullong next_id;
+	// lock-free submission stack, newest first
+	_Atomic(struct submission *) queue;
+	// submissions waiting for the socket to become writable, oldest first
+	struct submission *pending;
+	struct submission **pending_tail;
+	bool want_write;
+	// open addressed table of in-flight requests keyed by request ID
+	struct inflight *tbl;
+	size_t mask;
+	size_t used;
+	char buf[CLIENT_BUFSZ];
+};
+
+static void tbl_insert(struct ipc_client *c, const struct inflight *f);
+
+static void tbl_grow(struct ipc_client *c)
+{
+	struct inflight *old = c->tbl;
+	size_t oldn = c->mask + 1;
+	c->mask = oldn * 2 - 1;
+	c->tbl = calloc(oldn * 2, sizeof(*c->tbl));
+	c->used = 0;
+	for (size_t i = 0; i < oldn; i++) {
+		if (old[i].id) {
+			tbl_insert(c, &old[i]);
+		}
+	}
+	free(old);
+}
+
+static void tbl_insert(struct ipc_client *c, const struct inflight *f)
+{
+	if ((c->used + 1) * 2 > c->mask + 1) {
+		tbl_grow(c);
+	}
+	// IDs are mostly sequential so the low bits spread well
+	size_t i = f->id & c->mask;
+	while (c->tbl[i].id) {
+		i = (i + 1) & c->mask;
+	}
+	c->tbl[i] = *f;
+	c->used++;
+}
+
+static struct inflight *tbl_find(struct ipc_client *c, uint64_t id)
+{
+	for (size_t i = id & c->mask; c->tbl[i].id; i = (i + 1) & c->mask) {
+		if (c->tbl[i].id == id) {
+			return &c->tbl[i];
+		}
+	}
+	return NULL;
+}
+
+static bool tbl_remove(struct ipc_client *c, uint64_t id, struct inflight *f)
+{
+	size_t i = id & c->mask;
+	while (c->tbl[i].id != id) {
+		if (!c->tbl[i].id) {
+			return false;
+		}
+		i = (i + 1) & c->mask;
+	}
+	*f = c->tbl[i];
+
+	// shift back any following entries that would otherwise no longer be
+	// reachable from their home slot
+	for (size_t j = (i + 1) & c->mask; c->tbl[j].id; j = (j + 1) & c->mask) {
+		size_t k = c->tbl[j].id & c->mask;
+		bool between = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+		if (!between) {
+			c->tbl[i] = c->tbl[j];
+			i = j;
+		}
+	}
+	c->tbl[i].id = 0;
+	c->used--;
+	return true;
+}
+
+static void free_submission(struct submission *s)
+{
+	for (int i = 0; i < s->fdn; i++) {
+		close(s->fds[i]);
+	}
+	free(s);
+}
+
+static void fail_all(struct ipc_client *c)
+{
+	atomic_store(&c->failed, true);
+
+	struct submission *s = atomic_exchange(&c->queue, NULL);
+	while (s) {
+		struct submission *next = s->next;
+		s->cb(s->udata, NULL, NULL, 0);
+		free_submission(s);
+		s = next;
+	}
+
+	while (c->pending) {
+		s = c->pending;
+		c->pending = s->next;
+		s->cb(s->udata, NULL, NULL, 0);
+		free_submission(s);
+	}
+	c->pending_tail = &c->pending;
+
+	for (size_t i = 0; i <= c->mask; i++) {
+		if (c->tbl[i].id) {
+			struct inflight f = c->tbl[i];
+			c->tbl[i].id = 0;
+			f.cb(f.udata, NULL, NULL, 0);
+		}
+	}
+	c->used = 0;
+}
+
+static void set_want_write(struct ipc_client *c, bool want)
+{
+	if (c->want_write != want) {
+		struct epoll_event ev = {
+			.events = EPOLLIN | (want ? EPOLLOUT : 0),
+			.data.fd = c->fd,
+		};
+		epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+		c->want_write = want;
+	}
+}
+
+struct ipc_client *ipc_client_new(int fd)
+{
+	struct ipc_client *c = calloc(1, sizeof(*c));
+	if (!c) {
+		return NULL;
+	}
+	c->fd = fd;
+	c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	c->epfd = epoll_create1(EPOLL_CLOEXEC);
+	c->pending_tail = &c->pending;
+	c->mask = 63;
+	c->tbl = calloc(c->mask + 1, sizeof(*c->tbl));
+	atomic_init(&c->failed, false);
+	atomic_init(&c->next_id, 1);
+	atomic_init(&c->queue, NULL);
+
+	struct epoll_event sev = { .events = EPOLLIN, .data.fd = fd };
+	struct epoll_event eev = { .events = EPOLLIN, .data.fd = c->efd };
+	if (c->efd < 0 || c->epfd < 0 || !c->tbl ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) ||
+	    epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &sev) ||
+	    epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->efd, &eev)) {
+		ipc_client_free(c);
+		return NULL;
+	}
+	return c;
+}
+
+struct ipc_client *ipc_client_local(struct ipc_server *s)
+{
+	struct ipc_client *c = calloc(1, sizeof(*c));
+	if (!c) {
+		return NULL;
+	}
+	c->fd = -1;
+	c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	c->epfd = epoll_create1(EPOLL_CLOEXEC);
+	c->pending_tail = &c->pending;
+	c->mask = 63;
+	c->tbl = calloc(c->mask + 1, sizeof(*c->tbl));
+	atomic_init(&c->failed, false);
+	atomic_init(&c->next_id, 1);
+	atomic_init(&c->queue, NULL);
+	c->local = ipc_server_local(s);
+
+	struct epoll_event eev = { .events = EPOLLIN, .data.fd = c->efd };
+	struct epoll_event lev = { .events = EPOLLIN };
+	if (c->efd < 0 || c->epfd < 0 || !c->tbl || !c->local ||
+	    epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->efd, &eev) ||
+	    epoll_ctl(c->epfd, EPOLL_CTL_ADD, ipc_local_fd(c->local), &lev)) {
+		ipc_client_free(c);
+		return NULL;
+	}
+	return c;
+}
+
+struct ipc_client *ipc_client_connect(const char *path)
+{
+	int fd = ipc_unix_connect(path);
+	if (fd < 0) {
+		return NULL;
+	}
+	return ipc_client_new(fd);
+}
+
+void ipc_client_free(struct ipc_client *c)
+{
+	if (!c) {
+		return;
+	}
+	fail_all(c);
+	if (c->epfd >= 0) {
+		close(c->epfd);
+	}
+	if (c->efd >= 0) {
+		close(c->efd);
+	}
+	if (c->fd >= 0) {
+		close(c->fd);
+	}
+	ipc_local_close(c->local);
+	free(c->tbl);
+	free(c);
+}
+
+int ipc_client_fd(struct ipc_client *c)
+{
+	return c->epfd;
+}
+
+int ipc_client_vsubmit(struct ipc_client *c, ipc_reply_fn cb, void *udata,
+		       const int *fds, int fdn, const char *fmt, va_list ap)
+{
+	return ipc_client_vstream(c, NULL, cb, udata, fds, fdn, fmt, ap);
+}
+
+int ipc_client_vstream(struct ipc_client *c, ipc_reply_fn part,
+		       ipc_reply_fn cb, void *udata, const int *fds, int fdn,
+		       const char *fmt, va_list ap)
+{
+	if (fdn > CLIENT_MAX_FDS || atomic_load(&c->failed)) {
+		return -1;
+	}
+
+	uint64_t id = atomic_fetch_add(&c->next_id, 1);
+	char tmp[512];
+	int hdr = sipc_format(tmp, sizeof(tmp), "I %llu\n",
+			      (unsigned long long)id);
+
+	va_list aq;
+	va_copy(aq, ap);
+	int n = sipc_vformat(tmp + hdr, sizeof(tmp) - hdr, fmt, aq);
+	va_end(aq);
+	if (n < 0) {
+		return -1;
+	}
+
+	bool fits = n < (int)sizeof(tmp) - hdr;
+	int cap = fits ? hdr + n : hdr + n + FORMAT_SLACK;
+	if (cap > CLIENT_BUFSZ) {
+		return -1;
+	}
+	struct submission *s = malloc(sizeof(*s) + cap);
+	if (!s) {
+		return -1;
+	}
+	memcpy(s->buf, tmp, fits ? hdr + n : hdr);
+	if (!fits) {
+		// first pass only gave us the size
+		va_copy(aq, ap);
+		n = sipc_vformat(s->buf + hdr, cap - hdr, fmt, aq);
+		va_end(aq);
+		if (n < 0 || n >= cap - hdr) {
+			free(s);
+			return -1;
+		}
+	}
+
+	s->part = part;
+	s->cb = cb;
+	s->udata = udata;
+	s->id = id;
+	s->len = hdr + n;
+	s->fdn = 0;
+	for (int i = 0; i < fdn; i++) {
+		// the request is sent later from the dispatch thread
+		int fd = fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+		if (fd < 0) {
+			free_submission(s);
+			return -1;
+		}
+		s->fds[s->fdn++] = fd;
+	}
+
+	struct submission *head = atomic_load(&c->queue);
+	do {
+		s->next = head;
+	} while (!atomic_compare_exchange_weak(&c->queue, &head, s));
+
+	if (!head) {
+		// first entry in the queue - wake the dispatch thread
+		uint64_t one = 1;
+		write(c->efd, &one, sizeof(one));
+	}
+	return 0;
+}
+
+int ipc_client_submit(struct ipc_client *c, ipc_reply_fn cb, void *udata,
+		      const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = ipc_client_vsubmit(c, cb, udata, NULL, 0, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+int ipc_client_stream(struct ipc_client *c, ipc_reply_fn part,
+		      ipc_reply_fn cb, void *udata, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = ipc_client_vstream(c, part, cb, udata, NULL, 0, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+static int send_pending(struct ipc_client *c)
+{
+	while (c->pending) {
+		struct submission *s = c->pending;
+		if (c->local) {
+			if (ipc_local_send(c->local, s->buf, s->len, s->fds,
+					   s->fdn)) {
+				return -1;
+			}
+			// now owned by the server
+			s->fdn = 0;
+		} else {
+			int r = ipc_unix_sendmsg(c->fd, s->buf, s->len, s->fds,
+						 s->fdn);
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				set_want_write(c, true);
+				return 0;
+			} else if (r != s->len) {
+				return -1;
+			}
+		}
+
+		struct inflight f = {
+			.id = s->id,
+			.part = s->part,
+			.cb = s->cb,
+			.udata = s->udata,
+		};
+		tbl_insert(c, &f);
+		c->pending = s->next;
+		free_submission(s);
+	}
+	c->pending_tail = &c->pending;
+	if (!c->local) {
+		set_want_write(c, false);
+	}
+	return 0;
+}
+
+static void handle_reply(void *udata, const char *buf, int len,
+			 const int *fds, int fdn)
+{
+	struct ipc_client *c = udata;
+	sipc_parser_t p;
+	uint64_t id;
+	struct inflight f, *pf;
+	if (sipc_init(&p, buf, len) || sipc_request_id(&p, &id) <= 0) {
+		// untagged reply
+	} else if (sipc_peek(&p) != SIPC_PART) {
+		if (tbl_remove(c, id, &f)) {
+			f.cb(f.udata, &p, fds, fdn);
+			return;
+		}
+	} else if ((pf = tbl_find(c, id)) != NULL && pf->part) {
+		pf->part(pf->udata, &p, fds, fdn);
+		return;
+	}
+
+	// unknown reply or unwanted partial result
+	for (int i = 0; i < fdn; i++) {
+		close(fds[i]);
+	}
+}
+
+static int recv_replies(struct ipc_client *c)
+{
+	if (c->local) {
+		return ipc_local_recv(c->local, &handle_reply, c);
+	}
+	for (;;) {
+		int fds[CLIENT_MAX_FDS];
+		int fdn = CLIENT_MAX_FDS;
+		int r = ipc_unix_recvmsg(c->fd, c->buf, sizeof(c->buf), fds,
+					 &fdn);
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		} else if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r <= 0) {
+			return -1;
+		}
+		handle_reply(c, c->buf, r, fds, fdn);
+	}
+}
+
+int ipc_client_dispatch(struct ipc_client *c)
+{
+	if (atomic_load(&c->failed)) {
+		fail_all(c);
+		return -1;
+	}
+
+	// clear the wakeup before taking the queue so that a concurrent
+	// submission either lands in this batch or wakes us again
+	uint64_t v;
+	read(c->efd, &v, sizeof(v));
+
+	struct submission *s = atomic_exchange(&c->queue, NULL);
+	struct submission *fifo = NULL;
+	while (s) {
+		struct submission *next = s->next;
+		s->next = fifo;
+		fifo = s;
+		s = next;
+	}
+	if (fifo) {
+		*c->pending_tail = fifo;
+		while (fifo->next) {
+			fifo = fifo->next;
+		}
+		c->pending_tail = &fifo->next;
+	}
+
+	if (send_pending(c) || recv_replies(c)) {
+		fail_all(c);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+#endif
@@ -0,0 +1,153 @@
+#pragma once
+#include "ipc.h"
+#include <stdarg.h>
+#include <stdbool.h>
+
+// Client side connection pool over a set of server replicas, each listening
+// on its own unix socket path. The pool keeps a number of warm SEQPACKET
+// connections per endpoint, sends each call to the replica with the least
+// outstanding requests and reconnects failed endpoints in the background.
+struct ipc_pool;
+
+struct ipc_pool_config {
+	// replica socket paths
+	const char *const *paths;
+	int pathn;
+	// warm connections kept per endpoint, defaults to 1
+	int warm;
+	// background reconnect interval in milliseconds, defaults to 100
+	int retry_ms;
+	// tag each request with a request ID (I submessage) and discard
+	// replies that don't match, e.g. left over from an abandoned call
+	bool tagged;
+	// busy poll for replies for up to this long before blocking (see
+	// ipc_unix_recvmsg_spin), zero disables spinning
+	long spin_ns;
+	// Hedging, only for pools whose calls are read only. If a call gets
+	// no reply within this percentile (e.g. 95) of recent call latencies,
+	// the request is also sent to another replica and the first reply
+	// wins. Requires tagged, calls with file descriptors are not hedged.
+	// Zero disables hedging.
+	double hedge_percentile;
+	// hedged requests allowed as a fraction of calls, defaults to 0.05
+	double hedge_budget;
+};
+
+// returns NULL on error
+struct ipc_pool *ipc_pool_new(const struct ipc_pool_config *cfg);
+void ipc_pool_free(struct ipc_pool *p);
+
+// A call borrows a pooled connection and its buffer, which is used for both
+// the request and the reply. On success reply is setup to parse the reply
+// message. It remains valid until ipc_pool_done returns the connection.
+struct ipc_call {
+	sipc_parser_t reply;
+	struct pool_conn *conn;
+};
+typedef struct ipc_call ipc_call_t;
+
+// Formats a request (see sipc_format), sends it and waits for the reply.
+// fds are sent with the request as ancillary data.
+// returns # of bytes in the reply
+// -ve on error, in which case ipc_pool_done must not be called
+int ipc_pool_call(struct ipc_pool *p, ipc_call_t *c, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 3, 4)))
+#endif
+	;
+int ipc_pool_vcall(struct ipc_pool *p, ipc_call_t *c, const int *fds, int fdn,
+		   const char *fmt, va_list ap)
+#ifdef __GNUC__
+	__attribute__((format(printf, 5, 0)))
+#endif
+	;
+void ipc_pool_done(struct ipc_pool *p, ipc_call_t *c);
+
+struct ipc_hedge_stats {
+	// calls eligible for hedging
+	unsigned long calls;
+	// calls that were sent to a second replica
+	unsigned long hedges;
+	// hedges whose reply arrived first
+	unsigned long wins;
+	// current hedge delay, zero until enough calls have been timed
+	long long delay_ns;
+};
+
+void ipc_pool_hedge_stats(struct ipc_pool *p, struct ipc_hedge_stats *s);
+
+// Fills out the busy poll counters accumulated over all calls
+struct ipc_spin;
+void ipc_pool_spin_stats(struct ipc_pool *p, struct ipc_spin *s);
+
+// Asynchronous client connection. Any number of threads may submit requests
+// concurrently through a lock-free queue. A single thread drives the
+// connection by polling ipc_client_fd for readability (e.g. from its own
+// poll/epoll loop) and then calling ipc_client_dispatch, which sends queued
+// requests and invokes the completion callbacks. Requests are tagged with
+// request IDs so that replies are routed even if the server sends them out
+// of order.
+struct ipc_client;
+
+// Completion callback. reply is setup to parse the reply after the request ID
+// and is only valid for the duration of the callback. The callback owns any
+// file descriptors received with the reply. reply is NULL if the connection
+// failed before the reply was received.
+typedef void (*ipc_reply_fn)(void *udata, sipc_parser_t *reply,
+			     const int *fds, int fdn);
+
+// returns NULL on error
+struct ipc_client *ipc_client_connect(const char *path);
+// takes ownership of a connected SEQPACKET socket
+// returns NULL on error
+struct ipc_client *ipc_client_new(int fd);
+struct ipc_server;
+// Connects to a server in the same process without going through a socket
+// (see ipc_server_local). Must be freed before the server.
+// returns NULL on error
+struct ipc_client *ipc_client_local(struct ipc_server *s);
+// Fails any outstanding requests. Must not race with ipc_client_submit.
+void ipc_client_free(struct ipc_client *c);
+
+// returns a file descriptor that is readable whenever ipc_client_dispatch
+// has work to do
+int ipc_client_fd(struct ipc_client *c);
+
+// Formats a request (see sipc_format) and queues it. Can be called from any
+// thread. fds are sent along with the request and are not closed.
+// returns zero on success, non-zero on error
+int ipc_client_submit(struct ipc_client *c, ipc_reply_fn cb, void *udata,
+		      const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 4, 5)))
+#endif
+	;
+int ipc_client_vsubmit(struct ipc_client *c, ipc_reply_fn cb, void *udata,
+		       const int *fds, int fdn, const char *fmt, va_list ap)
+#ifdef __GNUC__
+	__attribute__((format(printf, 6, 0)))
+#endif
+	;
+
+// Submits a request to a verb that streams its result (see
+// ipc_reply_part). part is called with each partial result (a P
+// submessage) as it arrives and cb once with the final reply. Partial
+// results of requests submitted without a part callback are dropped.
+int ipc_client_stream(struct ipc_client *c, ipc_reply_fn part,
+		      ipc_reply_fn cb, void *udata, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 5, 6)))
+#endif
+	;
+int ipc_client_vstream(struct ipc_client *c, ipc_reply_fn part,
+		       ipc_reply_fn cb, void *udata, const int *fds, int fdn,
+		       const char *fmt, va_list ap)
+#ifdef __GNUC__
+	__attribute__((format(printf, 7, 0)))
+#endif
+	;
+
+// Sends queued requests and invokes callbacks for any replies received.
+// Does not block.
+// returns zero on success, non-zero once the connection has failed
+int ipc_client_dispatch(struct ipc_client *c);
@@ -0,0 +1,27 @@
+#pragma once
+
+// Log-linear latency histograms shared by the client and the server. Each
+// power of two is split into four buckets, so bucket bounds are within 25%.
+// Values under 4 get a bucket each, which leaves buckets 4-7 unused.
+
+// returns the bucket for ns, clamped to the last of n buckets
+static inline int ipc_hist_bucket(long long ns, int n)
+{
+	if (ns < 4) {
+		return ns < 0 ? 0 : (int)ns;
+	}
+	int e = 63 - __builtin_clzll((unsigned long long)ns);
+	int b = e * 4 + (int)((ns >> (e - 2)) & 3);
+	return b < n ? b : n - 1;
+}
+
+// returns the upper bound of bucket b in ns
+static inline long long ipc_hist_upper(int b)
+{
+	if (b < 4) {
+		return b + 1;
+	} else if (b < 8) {
+		return 4;
+	}
+	return (long long)(5 + b % 4) << (b / 4 - 2);
+}
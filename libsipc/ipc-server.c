@@ -0,0 +1,3684 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include "ipc-server.h"
+#include "ipc-hist.h"
+#include "ipc-unix.h"
+#include "ipc-trace.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define SERVER_BUFSZ 65536
+#define SERVER_MAX_FDS 16
+// messages read from one connection before servicing the others
+#define RECV_BATCH 32
+#define EVENT_BATCH 64
+// longest deadline honoured, longer ones are clamped
+#define MAX_DEADLINE_SECS 1e6
+// rate limited clients tracked, any more share one bucket
+#define BUCKETS 1024
+// partial replies a handler may have waiting to be sent before it blocks
+#define MAX_PARTS_QUEUED 16
+// events sent to a subscriber per sendmmsg
+#define SUB_BATCH 32
+// response cache shards, each with its own lock
+#define CACHE_SHARDS 64
+// latency histogram buckets, four per power of two up to about 18 minutes
+#define STAT_BUCKETS 164
+// slow requests an I/O thread can have waiting to be logged
+#define SLOW_RING 256
+// how often the slow log thread writes out queued requests
+#define SLOW_DRAIN_MS 100
+
+enum request_state {
+	REQ_QUEUED,
+	REQ_RUNNING,
+	// replied to with a timeout before a worker picked it up
+	REQ_EXPIRED,
+};
+
+// a loop's batch of connections for the successor (see migrate)
+enum handoff_state {
+	HANDOFF_IDLE,
+	HANDOFF_QUEUED,
+	// being sent by the handover thread
+	HANDOFF_SENDING,
+	// the successor has them, the loop closes its copies
+	HANDOFF_SENT,
+};
+
+struct handler {
+	char *verb;
+	int verbn;
+	ipc_handler_fn fn;
+	void *udata;
+	enum ipc_priority prio;
+	// replies are cached (see ipc_server_cache)
+	bool cached;
+	// identical requests share one run (see ipc_server_coalesce)
+	bool coalesced;
+	// bumped to invalidate the verb's cached replies
+	atomic_uint gen;
+};
+
+enum stat_kind {
+	// read to handed to a worker (or the ready list)
+	STAT_PARSE,
+	// waiting for a worker
+	STAT_QUEUE,
+	// handler start to the final reply
+	STAT_HANDLER,
+	// final reply to sent, including waiting on earlier replies
+	STAT_SEND,
+	STAT_KINDS,
+};
+
+// Per verb counters of an I/O thread. Only the thread itself writes them,
+// the stats verb merges them across threads.
+struct verb_stats {
+	atomic_ulong requests;
+	atomic_ulong errors;
+	atomic_ulong hist[STAT_KINDS][STAT_BUCKETS];
+};
+
+// A request over the slow log threshold (see ipc_server_config.slow_ns)
+struct slow_entry {
+	long long read_ns;
+	long long parsed_ns;
+	long long start_ns;
+	long long done_ns;
+	long long sent_ns;
+	int len;
+	int fdn;
+	int replylen;
+	int replyfdn;
+	bool failed;
+	int verbn;
+	char verb[32];
+};
+
+// Filled by an I/O thread at tail and emptied by the slow log thread at head
+struct slow_ring {
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+	// entries lost to a full ring since the last drain
+	atomic_ulong dropped;
+	struct slow_entry entries[SLOW_RING];
+};
+
+struct loop;
+struct conn;
+struct sub;
+struct cache_shard;
+struct flight_shard;
+
+struct ipc_request {
+	struct ipc_request *next;
+	struct conn *conn;
+	struct loop *loop;
+	// the in-process connection a request was sent on, until it is read
+	struct ipc_local *local;
+	const struct handler *h;
+	// position in the connection's reply order, untagged requests only
+	uint64_t seq;
+	uint64_t id;
+	bool tagged;
+	// counted in conn->running
+	bool running;
+	// monotonic ns, zero if the request has no deadline
+	long long deadline;
+	atomic_int state;
+	// timer wheel links, owned by the loop
+	struct ipc_request *tnext;
+	struct ipc_request **tpprev;
+	long long expires_ms;
+	// partial replies point at their request, which counts those
+	// waiting to be sent
+	struct ipc_request *parent;
+	bool part;
+	bool part_counted;
+	atomic_int parts;
+	// the reply may be cached, keyed on buf from keyoff
+	bool cacheable;
+	int keyoff;
+	int idlen;
+	unsigned gen;
+	// Coalesced requests. The leader is in the flight table and the
+	// others wait on it.
+	bool leader;
+	// replied to with a timeout before the handler ran
+	bool timed_out;
+	uint64_t khash;
+	struct ipc_request *fnext;
+	struct ipc_request *waiters;
+	// monotonic ns when read, parsed, started and completed, for the
+	// per verb statistics
+	long long read_ns;
+	long long parsed_ns;
+	long long start_ns;
+	long long done_ns;
+	sipc_parser_t args;
+	int fdn;
+	int fds[SERVER_MAX_FDS];
+	char *reply;
+	int replylen;
+	// length of the request ID at the start of the reply
+	int replyoff;
+	int replyfdn;
+	int replyfds[SERVER_MAX_FDS];
+	int len;
+	char buf[];
+};
+
+// Connections are owned by a single loop and are never touched by other
+// threads.
+struct conn {
+	struct conn *prev;
+	struct conn *next;
+	struct loop *loop;
+	int fd;
+	unsigned events;
+	struct bucket *bucket;
+	// in-process connections have no socket (fd is -1)
+	struct ipc_local *local;
+	uint64_t next_seq;
+	uint64_t send_seq;
+	// completed ahead of earlier requests, sorted by seq
+	struct ipc_request *held;
+	// replies waiting for the socket to become writable
+	struct ipc_request *outq;
+	struct ipc_request **outq_tail;
+	int inflight;
+	// requests handed to a handler and not yet completed, excluding
+	// partial replies, coalesced waiters and cache hits (see admit)
+	int running;
+	// subscriptions (see ipc_subscribe)
+	struct sub *subs;
+	// in the loop's list of connections with events to send
+	struct conn *dnext;
+	bool dirty;
+	bool subs_blocked;
+	bool read_closed;
+	bool want_write;
+	// the write side failed, remaining replies are dropped
+	bool dead;
+	bool freed;
+};
+
+// Hierarchical timer wheel with millisecond ticks. Level 0 covers the next
+// 256ms, each level above is 64 times coarser. Entries cascade down a level
+// as time reaches their slot.
+struct wheel {
+	long long now;
+	int count;
+	struct ipc_request *l0[256];
+	struct ipc_request *l1[64];
+	struct ipc_request *l2[64];
+};
+
+// Rate limit for one client using GCRA, which is equivalent to a token
+// bucket but needs only a single word of state.
+struct bucket {
+	// uid or pid, -1 if unused
+	atomic_llong key;
+	// theoretical arrival time of the next request in monotonic ns
+	atomic_llong tat;
+};
+
+struct newconn {
+	struct newconn *next;
+	int fd;
+	struct ipc_local *local;
+};
+
+// In-process connection (see ipc_server_local). Shared by the client and
+// the connection, each holding a reference.
+struct ipc_local {
+	struct loop *loop;
+	// owned by the loop, NULL once the connection is freed
+	struct conn *conn;
+	// readable when there are replies or the connection was closed
+	int efd;
+	// replies waiting for ipc_local_recv, newest first
+	_Atomic(struct ipc_request *) replies;
+	atomic_bool closed;
+	atomic_int ref;
+	// pushed by ipc_local_close to tell the loop the client has gone
+	struct ipc_request *eof;
+};
+
+struct loop {
+	struct ipc_server *srv;
+	int idx;
+	int epfd;
+	int efd;
+	thrd_t thread;
+	atomic_bool stop;
+	// set once the server is handing over to a successor
+	atomic_bool handover;
+	// Touched by other threads. Kept on their own cache line so that the
+	// loop's own state doesn't bounce between cores.
+	_Alignas(64) _Atomic(struct ipc_request *) done;
+	_Atomic(struct newconn *) newconns;
+	_Atomic(struct sub *) newsubs;
+	_Atomic(struct pubitem *) pubs;
+	// requests from in-process connections
+	_Atomic(struct ipc_request *) localreqs;
+	atomic_int nconns;
+	atomic_ulong accepted;
+	atomic_ulong requests;
+	atomic_ulong shed;
+	atomic_ulong cache_hits;
+	atomic_ulong coalesced;
+	atomic_int cpu;
+	atomic_int node;
+	_Alignas(64) struct conn *conns;
+	// connections freed at the end of the current batch of events
+	struct conn *dead;
+	int inflight;
+	unsigned next_worker;
+	// deadlines of requests queued for workers
+	struct wheel wheel;
+	struct conn *dirty;
+	// handing connections over, no more requests are read
+	bool draining;
+	bool drained;
+	// connections for the handover thread to send (see migrate), guarded
+	// by srv->handover_lk
+	struct conn *handoff[SERVER_MAX_FDS];
+	int handoffn;
+	enum handoff_state handoff_state;
+	// requests read in thread-per-core mode waiting to run, by priority
+	struct ipc_request *ready[IPC_PRIORITIES];
+	struct ipc_request **ready_tail[IPC_PRIORITIES];
+	unsigned credit[IPC_PRIORITIES];
+	// per verb, indexed like srv->handlers
+	struct verb_stats *stats;
+	// requests over the slow log threshold, NULL if there is no slow log
+	struct slow_ring *slow;
+	// mapped up front but first touched by the loop thread
+	char *buf;
+};
+
+// the owner takes from the head and thieves from the tail
+struct deque {
+	struct ipc_request **ring;
+	unsigned head;
+	unsigned tail;
+	unsigned mask;
+};
+
+struct worker {
+	struct ipc_server *srv;
+	int idx;
+	thrd_t thread;
+	mtx_t lk;
+	struct deque q[IPC_PRIORITIES];
+	// weighted scheduling credits left in the current round
+	unsigned credit[IPC_PRIORITIES];
+};
+
+struct ipc_server {
+	struct ipc_server_config cfg;
+	struct handler *handlers;
+	int handlern;
+	struct ipc_topic *topics;
+	struct cache_shard *cache;
+	size_t cache_budget;
+	struct flight_shard *flights;
+	struct loop *loops;
+	int loopn;
+	struct worker *workers;
+	int workern;
+	// BUCKETS entries plus one shared overflow bucket
+	struct bucket *buckets;
+	long long interval_ns;
+	long long burst_ns;
+	int *io_cpus;
+	int io_cpun;
+	int *worker_cpus;
+	int worker_cpun;
+	int lfd;
+	// wakes the accept thread
+	int accept_efd;
+	// slow request log, -1 if there is none
+	int slow_fd;
+	int slow_efd;
+	atomic_bool slow_stop;
+	thrd_t slow_thread;
+	// the successor's handover request, NULL until there is one
+	_Atomic(struct ipc_request *) handover;
+	// set once the listening socket is on its way to the successor, which
+	// stops the accept thread
+	atomic_bool handing_over;
+	// loops with connections left to hand over
+	atomic_int handover_loops;
+	// guards the loops' handoff batches and handover flags
+	mtx_t handover_lk;
+	// wakes the handover thread
+	int handover_efd;
+	thrd_t handover_thread;
+	bool handed_over;
+	cnd_t handed_cv;
+	thrd_t accept_thread;
+	// whether accept_thread is to be joined
+	bool accepting;
+	bool started;
+	atomic_bool stopping;
+	atomic_uint next_loop;
+	// requests sitting in worker deques, in total and by priority
+	atomic_int queued;
+	atomic_int pqueued[IPC_PRIORITIES];
+	unsigned weights[IPC_PRIORITIES];
+	atomic_int sleepers;
+	mtx_t idle_lk;
+	cnd_t idle_cv;
+};
+
+static _Thread_local struct loop *tls_loop;
+static _Thread_local char tls_fmt[SERVER_BUFSZ];
+static _Thread_local void *tls_core;
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static long long monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void wake(int efd)
+{
+	uint64_t one = 1;
+	write(efd, &one, sizeof(one));
+}
+
+static void pin_thread(struct ipc_server *s, bool worker, int idx)
+{
+	const int *cpus = worker ? s->worker_cpus : s->io_cpus;
+	int cpun = worker ? s->worker_cpun : s->io_cpun;
+	if (cpun) {
+		ipc_pin_cpu(cpus[idx % cpun]);
+	} else if (s->cfg.pin) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		idx += worker ? s->loopn : 0;
+		ipc_pin_cpu((int)((s->cfg.first_cpu + idx) % ncpu));
+	}
+}
+
+// parses a Linux CPU list such as "0-3,8,10-11"
+// returns the number of CPUs or -ve on error
+static int parse_cpulist(const char *str, int **pcpus)
+{
+	int *cpus = NULL;
+	int n = 0;
+	while (*str) {
+		char *end;
+		long first = strtol(str, &end, 10);
+		long last = first;
+		if (end == str || first < 0) {
+			goto err;
+		}
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str || last < first) {
+				goto err;
+			}
+		}
+		int *p = realloc(cpus, (n + last - first + 1) * sizeof(*cpus));
+		if (!p) {
+			goto err;
+		}
+		cpus = p;
+		for (long c = first; c <= last; c++) {
+			cpus[n++] = (int)c;
+		}
+		if (*end == ',') {
+			end++;
+		} else if (*end) {
+			goto err;
+		}
+		str = end;
+	}
+	*pcpus = cpus;
+	return n;
+err:
+	free(cpus);
+	return -1;
+}
+
+// Prefers the node for pages backing buf and then faults them in from the
+// calling thread. Without mbind (e.g. no NUMA support in the kernel), first
+// touch alone places them on the local node.
+static void touch_local(void *buf, size_t sz, int node)
+{
+	if (node >= 0 && node < (int)(8 * sizeof(unsigned long))) {
+		unsigned long mask = 1UL << node;
+		syscall(SYS_mbind, buf, sz, MPOL_PREFERRED, &mask,
+			8 * sizeof(mask), 0);
+	}
+	memset(buf, 0, sz);
+}
+
+static void complete(struct ipc_request *r);
+static void timer_add(struct wheel *w, struct ipc_request *r);
+static void error_reply(struct ipc_request *r, const char *code,
+			const char *desc);
+
+static void core_start(struct ipc_server *s, int idx)
+{
+	if (s->cfg.core_init) {
+		tls_core = s->cfg.core_init(s->cfg.core_udata, idx);
+	}
+}
+
+static void core_stop(struct ipc_server *s)
+{
+	if (s->cfg.core_free) {
+		s->cfg.core_free(s->cfg.core_udata, tls_core);
+	}
+	tls_core = NULL;
+}
+
+static void run_handler(struct ipc_request *r)
+{
+	r->start_ns = monotonic_ns();
+	SIPC_PROBE(dispatch, r, r->h->verb, r->h->verbn);
+	r->h->fn(r->h->udata, r, &r->args);
+}
+
+// replies to a request whose deadline passed before its handler ran
+static void time_out(struct ipc_request *r)
+{
+	r->timed_out = true;
+	ipc_error(r, "timeout", "deadline exceeded");
+}
+
+static void stat_inc(atomic_ulong *v)
+{
+	// single writer, so no need for a locked add
+	atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+}
+
+static void stat_time(struct verb_stats *vs, enum stat_kind k, long long ns)
+{
+	stat_inc(&vs->hist[k][ipc_hist_bucket(ns, STAT_BUCKETS)]);
+}
+
+static bool reply_failed(const struct ipc_request *r)
+{
+	const char *p = r->reply;
+	if (r->tagged) {
+		p = memchr(p, '\n', r->replylen);
+		p = p ? p + 1 : r->reply;
+	}
+	return *p == 'E';
+}
+
+// Queues a request for the slow log thread, dropping it if the ring is full
+static void slow_record(struct loop *l, struct ipc_request *r, long long now,
+			bool failed)
+{
+	struct slow_ring *q = l->slow;
+	unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&q->head, memory_order_acquire) ==
+	    SLOW_RING) {
+		atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	struct slow_entry *e = &q->entries[tail % SLOW_RING];
+	e->read_ns = r->read_ns;
+	e->parsed_ns = r->parsed_ns;
+	e->start_ns = r->start_ns;
+	e->done_ns = r->done_ns;
+	e->sent_ns = now;
+	e->len = r->len;
+	e->fdn = r->fdn;
+	e->replylen = r->replylen;
+	e->replyfdn = r->replyfdn;
+	e->failed = failed;
+	e->verbn = r->h->verbn < (int)sizeof(e->verb) ? r->h->verbn :
+							(int)sizeof(e->verb);
+	memcpy(e->verb, r->h->verb, e->verbn);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+// called by the loop thread once the final reply has been sent
+static void record_stats(struct loop *l, struct ipc_request *r)
+{
+	if (!r->h || r->part) {
+		return;
+	}
+	long long now = monotonic_ns();
+	bool failed = reply_failed(r);
+	struct verb_stats *vs = &l->stats[r->h - l->srv->handlers];
+	stat_inc(&vs->requests);
+	if (failed) {
+		stat_inc(&vs->errors);
+	}
+	stat_time(vs, STAT_PARSE, r->parsed_ns - r->read_ns);
+	if (r->start_ns) {
+		stat_time(vs, STAT_QUEUE, r->start_ns - r->parsed_ns);
+		stat_time(vs, STAT_HANDLER, r->done_ns - r->start_ns);
+	}
+	if (r->done_ns) {
+		stat_time(vs, STAT_SEND, now - r->done_ns);
+	}
+	if (l->slow && now - r->read_ns > l->srv->cfg.slow_ns) {
+		slow_record(l, r, now, failed);
+	}
+}
+
+static void free_request(struct ipc_request *r)
+{
+	if (r->part_counted) {
+		atomic_fetch_sub(&r->parent->parts, 1);
+	}
+	for (int i = 0; i < r->fdn; i++) {
+		if (r->fds[i] >= 0) {
+			close(r->fds[i]);
+		}
+	}
+	for (int i = 0; i < r->replyfdn; i++) {
+		close(r->replyfds[i]);
+	}
+	free(r->reply);
+	free(r);
+}
+
+///////////////////////////////
+// Workers
+
+// returns false if the deque is full and can't grow
+static bool worker_push(struct worker *w, struct ipc_request *r)
+{
+	mtx_lock(&w->lk);
+	struct deque *q = &w->q[r->h->prio];
+	if (q->tail - q->head > q->mask) {
+		unsigned n = q->mask + 1;
+		struct ipc_request **ring = malloc(2 * n * sizeof(*ring));
+		if (!ring) {
+			mtx_unlock(&w->lk);
+			return false;
+		}
+		for (unsigned i = 0; i < n; i++) {
+			ring[i] = q->ring[(q->head + i) & q->mask];
+		}
+		free(q->ring);
+		q->ring = ring;
+		q->head = 0;
+		q->tail = n;
+		q->mask = 2 * n - 1;
+	}
+	q->ring[q->tail++ & q->mask] = r;
+	mtx_unlock(&w->lk);
+	return true;
+}
+
+static struct ipc_request *worker_pop(struct worker *w, int prio)
+{
+	struct ipc_request *r = NULL;
+	struct deque *q = &w->q[prio];
+	mtx_lock(&w->lk);
+	if (q->head != q->tail) {
+		r = q->ring[q->head++ & q->mask];
+	}
+	mtx_unlock(&w->lk);
+	return r;
+}
+
+static struct ipc_request *worker_steal(struct worker *w, int prio)
+{
+	struct ipc_request *r = NULL;
+	struct deque *q = &w->q[prio];
+	mtx_lock(&w->lk);
+	if (q->head != q->tail) {
+		r = q->ring[--q->tail & q->mask];
+	}
+	mtx_unlock(&w->lk);
+	return r;
+}
+
+// Picks the priority class to run next from those set in mask. Strict
+// scheduling always picks the highest. Weighted scheduling runs up to
+// weights[p] requests from each class per round.
+static int pick_class(struct ipc_server *s, unsigned *credit, unsigned mask)
+{
+	if (s->cfg.sched == IPC_SCHED_WEIGHTED) {
+		for (int round = 0; round < 2; round++) {
+			for (int p = 0; p < IPC_PRIORITIES; p++) {
+				if ((mask & (1u << p)) && credit[p]) {
+					credit[p]--;
+					return p;
+				}
+			}
+			memcpy(credit, s->weights, sizeof(s->weights));
+		}
+	}
+	return __builtin_ctz(mask);
+}
+
+static struct ipc_request *take(struct ipc_server *s, struct worker *w)
+{
+	unsigned mask = 0;
+	for (int p = 0; p < IPC_PRIORITIES; p++) {
+		if (atomic_load_explicit(&s->pqueued[p], memory_order_relaxed)) {
+			mask |= 1u << p;
+		}
+	}
+	while (mask) {
+		int p = pick_class(s, w->credit, mask);
+		struct ipc_request *r = worker_pop(w, p);
+		for (int i = 1; !r && i < s->workern; i++) {
+			r = worker_steal(&s->workers[(w->idx + i) % s->workern],
+					 p);
+		}
+		if (r) {
+			atomic_fetch_sub(&s->pqueued[p], 1);
+			return r;
+		}
+		mask &= ~(1u << p);
+	}
+	return NULL;
+}
+
+static void dispatch(struct loop *l, struct ipc_request *r)
+{
+	struct ipc_server *s = l->srv;
+	if (r->deadline) {
+		// round up so that the timer never fires early
+		r->expires_ms = r->deadline / 1000000 + 1;
+		timer_add(&l->wheel, r);
+	}
+	if (!worker_push(&s->workers[l->next_worker++ % s->workern], r)) {
+		// completing takes it off the timer wheel again
+		ipc_error(r, "overloaded", "out of memory");
+		return;
+	}
+	atomic_fetch_add(&s->pqueued[r->h->prio], 1);
+
+	// Pairs with the sleepers/queued check in worker_thread. Either the
+	// worker sees the new request or we see the sleeper.
+	atomic_fetch_add(&s->queued, 1);
+	if (atomic_load(&s->sleepers)) {
+		mtx_lock(&s->idle_lk);
+		cnd_signal(&s->idle_cv);
+		mtx_unlock(&s->idle_lk);
+	}
+}
+
+static int worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct ipc_server *s = w->srv;
+	pin_thread(s, true, w->idx);
+	core_start(s, w->idx);
+
+	for (;;) {
+		struct ipc_request *r = take(s, w);
+		if (r) {
+			atomic_fetch_sub(&s->queued, 1);
+			int queued = REQ_QUEUED;
+			if (!atomic_compare_exchange_strong(&r->state, &queued,
+							    REQ_RUNNING)) {
+				// the loop has already replied, hand it back
+				// to be freed
+				complete(r);
+			} else if (ipc_request_expired(r)) {
+				time_out(r);
+			} else {
+				run_handler(r);
+			}
+			continue;
+		}
+
+		mtx_lock(&s->idle_lk);
+		atomic_fetch_add(&s->sleepers, 1);
+		while (!atomic_load(&s->queued) && !atomic_load(&s->stopping)) {
+			cnd_wait(&s->idle_cv, &s->idle_lk);
+		}
+		atomic_fetch_sub(&s->sleepers, 1);
+		bool stop = atomic_load(&s->stopping) && !atomic_load(&s->queued);
+		mtx_unlock(&s->idle_lk);
+		if (stop) {
+			core_stop(s);
+			return 0;
+		}
+	}
+}
+
+///////////////////////////////
+// Connections
+
+// frees the replies the client hasn't read
+static void local_drop(struct ipc_local *lc)
+{
+	// oldest first, parts refer to the request they belong to
+	struct ipc_request *r = atomic_exchange(&lc->replies, NULL);
+	struct ipc_request *fifo = NULL;
+	while (r) {
+		struct ipc_request *next = r->next;
+		r->next = fifo;
+		fifo = r;
+		r = next;
+	}
+	while (fifo) {
+		struct ipc_request *next = fifo->next;
+		free_request(fifo);
+		fifo = next;
+	}
+}
+
+static void local_release(struct ipc_local *lc)
+{
+	if (atomic_fetch_sub(&lc->ref, 1) == 1) {
+		local_drop(lc);
+		close(lc->efd);
+		free(lc->eof);
+		free(lc);
+	}
+}
+
+// hands a reply to the in-process client as is
+static void local_push(struct ipc_local *lc, struct ipc_request *r)
+{
+	struct ipc_request *head = atomic_load(&lc->replies);
+	do {
+		r->next = head;
+	} while (!atomic_compare_exchange_weak(&lc->replies, &head, r));
+	if (!head) {
+		wake(lc->efd);
+	}
+}
+
+static void conn_update_events(struct conn *c)
+{
+	unsigned events = 0;
+	if (c->local) {
+		return;
+	}
+	if (!c->dead) {
+		events = (c->read_closed || c->loop->draining ? 0 : EPOLLIN) |
+			 (c->want_write ? EPOLLOUT : 0);
+	}
+	if (events == c->events) {
+		return;
+	}
+	struct epoll_event ev = { .events = events, .data.ptr = c };
+	int op = !c->events ? EPOLL_CTL_ADD :
+			      !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+	epoll_ctl(c->loop->epfd, op, c->fd, &ev);
+	c->events = events;
+}
+
+static void conn_flush(struct conn *c)
+{
+	while (c->outq) {
+		struct ipc_request *r = c->outq;
+		if (!r->reply) {
+			// ran out of memory formatting the reply, the
+			// connection is out of sync
+			c->dead = true;
+		}
+		if (!c->dead && c->local) {
+			c->outq = r->next;
+			c->inflight--;
+			c->loop->inflight--;
+			SIPC_PROBE(reply, r, r->replylen, r->replyfdn, r->part);
+			record_stats(c->loop, r);
+			local_push(c->local, r);
+			continue;
+		} else if (!c->dead) {
+			int n = ipc_unix_sendmsg(c->fd, r->reply, r->replylen,
+						 r->replyfds, r->replyfdn);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				c->want_write = true;
+				return;
+			} else if (n != r->replylen) {
+				c->dead = true;
+			} else {
+				SIPC_PROBE(reply, r, n, r->replyfdn, r->part);
+				record_stats(c->loop, r);
+			}
+		}
+		c->outq = r->next;
+		c->inflight--;
+		c->loop->inflight--;
+		free_request(r);
+	}
+	c->outq_tail = &c->outq;
+	c->want_write = c->subs_blocked;
+}
+
+static void append_out(struct conn *c, struct ipc_request *r)
+{
+	r->next = NULL;
+	*c->outq_tail = r;
+	c->outq_tail = &r->next;
+}
+
+static void timer_del(struct wheel *w, struct ipc_request *r);
+
+static void conn_complete(struct conn *c, struct ipc_request *r)
+{
+	timer_del(&c->loop->wheel, r);
+	if (r->running) {
+		r->running = false;
+		c->running--;
+	}
+	if (r->part) {
+		c->inflight++;
+		c->loop->inflight++;
+	} else if (atomic_load(&r->state) == REQ_EXPIRED) {
+		// the timeout reply has taken its place
+		c->inflight--;
+		c->loop->inflight--;
+		free_request(r);
+		return;
+	}
+
+	if (r->tagged) {
+		append_out(c, r);
+	} else if (r->seq == c->send_seq) {
+		// partial replies go out straight away but the next request's
+		// replies wait for the final one
+		append_out(c, r);
+		c->send_seq += !r->part;
+		while (c->held && c->held->seq == c->send_seq) {
+			struct ipc_request *next = c->held->next;
+			c->send_seq += !c->held->part;
+			append_out(c, c->held);
+			c->held = next;
+		}
+	} else {
+		// after any earlier parts of the same request
+		struct ipc_request **pp = &c->held;
+		while (*pp && (*pp)->seq <= r->seq) {
+			pp = &(*pp)->next;
+		}
+		r->next = *pp;
+		*pp = r;
+		if (r->part_counted) {
+			// Don't hold up the handler. The parts can't go out
+			// until an earlier request completes, which may be
+			// queued behind it.
+			atomic_fetch_sub(&r->parent->parts, 1);
+			r->part_counted = false;
+		}
+	}
+	conn_flush(c);
+}
+
+static void end_subs(struct conn *c);
+
+// frees the connection once nothing more can happen on it
+static void conn_check(struct conn *c)
+{
+	if (c->freed) {
+		return;
+	}
+	if (c->dead) {
+		c->read_closed = true;
+	}
+	if (c->read_closed && c->subs) {
+		end_subs(c);
+	}
+	conn_update_events(c);
+	if (!c->read_closed || c->inflight) {
+		return;
+	}
+
+	struct loop *l = c->loop;
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		l->conns = c->next;
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	}
+	if (c->local) {
+		struct ipc_local *lc = c->local;
+		lc->conn = NULL;
+		atomic_store(&lc->closed, true);
+		wake(lc->efd);
+		local_release(lc);
+	} else {
+		close(c->fd);
+	}
+	atomic_fetch_sub(&l->nconns, 1);
+	c->freed = true;
+	// other events in this batch may still refer to it
+	c->next = l->dead;
+	l->dead = c;
+}
+
+///////////////////////////////
+// Response cache
+
+// Every value has a single encoding, so repeats of a request are byte
+// identical from the R submessage on. Entries are keyed on those bytes and
+// hold the reply without its request ID.
+struct cache_entry {
+	struct cache_entry *next;
+	uint64_t hash;
+	const struct handler *h;
+	unsigned gen;
+	// CLOCK reference bit
+	bool ref;
+	// index in the shard's clock
+	int slot;
+	int keylen;
+	int replylen;
+	char data[];
+};
+
+struct cache_shard {
+	_Alignas(64) mtx_t lk;
+	struct cache_entry **table;
+	unsigned mask;
+	// entries in no particular order, swept by hand
+	struct cache_entry **clock;
+	int n;
+	int cap;
+	// index into clock, wrapped to stay below n
+	unsigned hand;
+	size_t bytes;
+};
+
+static uint64_t cache_hash(const char *buf, int n)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ (uint64_t)n;
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t v;
+		memcpy(&v, buf + i, 8);
+		h = (h ^ v) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	for (; i < n; i++) {
+		h = (h ^ (unsigned char)buf[i]) * 0x100000001B3ULL;
+	}
+	h ^= h >> 29;
+	return h * 0xC4CEB9FE1A85EC53ULL;
+}
+
+// Finds the key, which starts at the R submessage, without parsing the
+// request. idlen is set to the length of the leading I submessage if any.
+// returns the offset of the key or -1
+static int cache_key(const char *buf, int n, int *idlen)
+{
+	int off = 0;
+	*idlen = 0;
+	if (n > 0 && buf[0] == 'I') {
+		const char *nl = memchr(buf, '\n', n);
+		if (!nl) {
+			return -1;
+		}
+		off = *idlen = (int)(nl - buf) + 1;
+	}
+	// deadlines don't change the reply
+	if (off < n && buf[off] == 'D') {
+		const char *nl = memchr(buf + off, '\n', n - off);
+		if (!nl) {
+			return -1;
+		}
+		off = (int)(nl - buf) + 1;
+	}
+	return n - off > 2 && buf[off] == 'R' ? off : -1;
+}
+
+static size_t entry_size(const struct cache_entry *e)
+{
+	return sizeof(*e) + e->keylen + e->replylen;
+}
+
+static bool entry_valid(const struct cache_entry *e)
+{
+	return e->gen == atomic_load_explicit(&e->h->gen,
+					      memory_order_relaxed);
+}
+
+static void cache_remove(struct cache_shard *sh, struct cache_entry *e)
+{
+	struct cache_entry **pp = &sh->table[e->hash & sh->mask];
+	while (*pp != e) {
+		pp = &(*pp)->next;
+	}
+	*pp = e->next;
+	sh->clock[e->slot] = sh->clock[--sh->n];
+	sh->clock[e->slot]->slot = e->slot;
+	sh->bytes -= entry_size(e);
+	free(e);
+}
+
+static struct cache_entry *cache_find(struct cache_shard *sh, uint64_t hash,
+				      const char *key, int keylen)
+{
+	struct cache_entry *e = sh->table[hash & sh->mask];
+	while (e && (e->hash != hash || e->keylen != keylen ||
+		     memcmp(e->data, key, keylen))) {
+		e = e->next;
+	}
+	return e;
+}
+
+static bool cache_grow(struct cache_shard *sh)
+{
+	int cap = sh->cap ? 2 * sh->cap : 64;
+	struct cache_entry **clock = realloc(sh->clock, cap * sizeof(*clock));
+	if (!clock) {
+		return false;
+	}
+	sh->clock = clock;
+	sh->cap = cap;
+	if ((unsigned)sh->n < sh->mask + 1) {
+		return true;
+	}
+	// keep the load factor at most one
+	unsigned mask = 2 * (sh->mask + 1) - 1;
+	struct cache_entry **table = calloc(mask + 1, sizeof(*table));
+	if (!table) {
+		return true;
+	}
+	for (unsigned i = 0; i <= sh->mask; i++) {
+		while (sh->table[i]) {
+			struct cache_entry *e = sh->table[i];
+			sh->table[i] = e->next;
+			e->next = table[e->hash & mask];
+			table[e->hash & mask] = e;
+		}
+	}
+	free(sh->table);
+	sh->table = table;
+	sh->mask = mask;
+	return true;
+}
+
+// Stores the reply of a completed request, dropping entries that haven't
+// been hit since the hand last passed them until it fits in the budget.
+static void cache_put(struct ipc_server *s, struct ipc_request *r)
+{
+	const char *key = r->buf + r->keyoff;
+	int keylen = r->len - r->keyoff;
+	// the reply starts with the same I submessage as the request
+	const char *reply = r->reply + r->idlen;
+	int replylen = r->replylen - r->idlen;
+	if (r->replyfdn || replylen <= 0 || reply[0] != 'S' ||
+	    memcmp(r->reply, r->buf, r->idlen)) {
+		return;
+	}
+	size_t sz = sizeof(struct cache_entry) + keylen + replylen;
+	if (sz > s->cache_budget / CACHE_SHARDS) {
+		return;
+	}
+	struct cache_entry *e = malloc(sz);
+	if (!e) {
+		return;
+	}
+	e->hash = cache_hash(key, keylen);
+	e->h = r->h;
+	e->gen = r->gen;
+	e->ref = false;
+	e->keylen = keylen;
+	e->replylen = replylen;
+	memcpy(e->data, key, keylen);
+	memcpy(e->data + keylen, reply, replylen);
+
+	struct cache_shard *sh = &s->cache[e->hash % CACHE_SHARDS];
+	mtx_lock(&sh->lk);
+	struct cache_entry *old = cache_find(sh, e->hash, key, keylen);
+	if (old) {
+		cache_remove(sh, old);
+	}
+	while (sh->n && sh->bytes + sz > s->cache_budget / CACHE_SHARDS) {
+		if (sh->hand >= (unsigned)sh->n) {
+			sh->hand = 0;
+		}
+		struct cache_entry *v = sh->clock[sh->hand];
+		if (v->ref && entry_valid(v)) {
+			v->ref = false;
+			sh->hand++;
+		} else {
+			// the last entry moves into its slot
+			cache_remove(sh, v);
+		}
+	}
+	if (sh->n == sh->cap && !cache_grow(sh)) {
+		mtx_unlock(&sh->lk);
+		free(e);
+		return;
+	}
+	e->next = sh->table[e->hash & sh->mask];
+	sh->table[e->hash & sh->mask] = e;
+	e->slot = sh->n;
+	sh->clock[sh->n++] = e;
+	sh->bytes += sz;
+	mtx_unlock(&sh->lk);
+}
+
+// Replies to the request from the cache without parsing it.
+// returns false on a miss
+static bool cache_reply(struct loop *l, struct conn *c, const char *buf,
+			int n)
+{
+	struct ipc_server *s = l->srv;
+	int idlen;
+	int off = cache_key(buf, n, &idlen);
+	if (off < 0) {
+		return false;
+	}
+	uint64_t hash = cache_hash(buf + off, n - off);
+	struct cache_shard *sh = &s->cache[hash % CACHE_SHARDS];
+	mtx_lock(&sh->lk);
+	struct cache_entry *e = cache_find(sh, hash, buf + off, n - off);
+	if (!e || !entry_valid(e)) {
+		mtx_unlock(&sh->lk);
+		return false;
+	}
+	struct ipc_request *r = calloc(1, sizeof(*r));
+	char *reply = r ? malloc(idlen + e->replylen) : NULL;
+	if (!reply) {
+		mtx_unlock(&sh->lk);
+		free(r);
+		return false;
+	}
+	e->ref = true;
+	memcpy(reply, buf, idlen);
+	memcpy(reply + idlen, e->data + e->keylen, e->replylen);
+	r->replylen = idlen + e->replylen;
+	mtx_unlock(&sh->lk);
+
+	r->conn = c;
+	r->loop = l;
+	r->reply = reply;
+	r->tagged = idlen > 0;
+	if (!r->tagged) {
+		r->seq = c->next_seq++;
+	}
+	c->inflight++;
+	l->inflight++;
+	atomic_fetch_add_explicit(&l->requests, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&l->cache_hits, 1, memory_order_relaxed);
+	conn_complete(c, r);
+	return true;
+}
+
+///////////////////////////////
+// Coalescing
+
+#define FLIGHT_BUCKETS 64
+
+// requests currently running for coalesced verbs, by key
+struct flight_shard {
+	_Alignas(64) mtx_t lk;
+	struct ipc_request *table[FLIGHT_BUCKETS];
+};
+
+// Attaches the request to a running one with the same key, or makes it the
+// leader for later ones.
+// returns true if it is now waiting on another request
+static bool flight_join(struct ipc_server *s, struct ipc_request *r)
+{
+	const char *key = r->buf + r->keyoff;
+	int keylen = r->len - r->keyoff;
+	r->khash = cache_hash(key, keylen);
+	struct flight_shard *sh = &s->flights[r->khash % CACHE_SHARDS];
+	struct ipc_request **head =
+		&sh->table[(r->khash / CACHE_SHARDS) % FLIGHT_BUCKETS];
+	mtx_lock(&sh->lk);
+	struct ipc_request *f = *head;
+	while (f && (f->khash != r->khash || f->len - f->keyoff != keylen ||
+		     memcmp(f->buf + f->keyoff, key, keylen))) {
+		f = f->fnext;
+	}
+	if (f) {
+		r->fnext = f->waiters;
+		f->waiters = r;
+	} else {
+		r->leader = true;
+		r->fnext = *head;
+		*head = r;
+	}
+	mtx_unlock(&sh->lk);
+	return f != NULL;
+}
+
+// Copies the leader's reply, behind the waiter's own request ID
+static void share_reply(struct ipc_request *r, struct ipc_request *w)
+{
+	if (!r->reply) {
+		return;
+	}
+	char id[32];
+	int idn = 0;
+	if (w->tagged) {
+		idn = sipc_format(id, sizeof(id), "I %llu\n",
+				  (unsigned long long)w->id);
+	}
+	int n = r->replylen - r->replyoff;
+	w->reply = malloc(idn + n);
+	if (!w->reply) {
+		return;
+	}
+	memcpy(w->reply, id, idn);
+	memcpy(w->reply + idn, r->reply + r->replyoff, n);
+	w->replylen = idn + n;
+	for (int i = 0; i < r->replyfdn; i++) {
+		int fd = fcntl(r->replyfds[i], F_DUPFD_CLOEXEC, 0);
+		if (fd >= 0) {
+			w->replyfds[w->replyfdn++] = fd;
+		}
+	}
+}
+
+// Removes a completed leader from the flight table and completes the
+// requests waiting on it. A leader's timeout is its own, so if it timed out
+// the oldest waiter whose deadline hasn't passed takes over as the leader
+// for the rest, which only time out on their own deadline.
+// returns the new leader, which the caller must run
+static struct ipc_request *flight_land(struct ipc_request *r)
+{
+	struct ipc_server *s = r->loop->srv;
+	struct flight_shard *sh = &s->flights[r->khash % CACHE_SHARDS];
+	struct ipc_request **pp =
+		&sh->table[(r->khash / CACHE_SHARDS) % FLIGHT_BUCKETS];
+	bool timed_out =
+		r->timed_out || atomic_load(&r->state) == REQ_EXPIRED;
+	struct ipc_request *heir = NULL;
+	mtx_lock(&sh->lk);
+	while (*pp != r) {
+		pp = &(*pp)->fnext;
+	}
+	struct ipc_request *w = r->waiters;
+	if (timed_out) {
+		// waiters are newest first, so this leaves heir the oldest
+		struct ipc_request *expired = NULL;
+		while (w) {
+			struct ipc_request *next = w->fnext;
+			if (ipc_request_expired(w)) {
+				w->fnext = expired;
+				expired = w;
+			} else {
+				w->fnext = heir;
+				heir = w;
+			}
+			w = next;
+		}
+		w = expired;
+	}
+	if (heir) {
+		heir->leader = true;
+		heir->waiters = heir->fnext;
+		heir->fnext = r->fnext;
+		*pp = heir;
+	} else {
+		*pp = r->fnext;
+	}
+	mtx_unlock(&sh->lk);
+	r->leader = false;
+	while (w) {
+		struct ipc_request *next = w->fnext;
+		if (timed_out) {
+			w->timed_out = true;
+			error_reply(w, "timeout", "deadline exceeded");
+		} else {
+			share_reply(r, w);
+		}
+		complete(w);
+		w = next;
+	}
+	return heir;
+}
+
+///////////////////////////////
+// Requests
+
+static const struct handler *find_handler(struct ipc_server *s,
+					  const char *verb, int verbn)
+{
+	for (int i = 0; i < s->handlern; i++) {
+		const struct handler *h = &s->handlers[i];
+		if (h->verbn == verbn && !memcmp(h->verb, verb, verbn)) {
+			return h;
+		}
+	}
+	return NULL;
+}
+
+static struct bucket *find_bucket(struct ipc_server *s, long long key)
+{
+	unsigned h = (unsigned)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 32);
+	for (int i = 0; i < BUCKETS; i++) {
+		struct bucket *b = &s->buckets[(h + i) & (BUCKETS - 1)];
+		long long k = -1;
+		if (atomic_compare_exchange_strong(&b->key, &k, key) ||
+		    k == key) {
+			return b;
+		}
+	}
+	return &s->buckets[BUCKETS];
+}
+
+static bool rate_admit(struct ipc_server *s, struct bucket *b)
+{
+	long long now = monotonic_ns();
+	long long tat = atomic_load_explicit(&b->tat, memory_order_relaxed);
+	for (;;) {
+		long long next = (tat > now ? tat : now) + s->interval_ns;
+		if (next - now > s->burst_ns) {
+			return false;
+		} else if (atomic_compare_exchange_weak(&b->tat, &tat, next)) {
+			return true;
+		}
+	}
+}
+
+// returns the reason the request should be shed or NULL to admit it
+static const char *admit(struct loop *l, struct conn *c)
+{
+	struct ipc_server *s = l->srv;
+	if (s->cfg.max_inflight && c->running >= s->cfg.max_inflight) {
+		return "too many requests in flight";
+	} else if (c->bucket && !rate_admit(s, c->bucket)) {
+		return "rate limit exceeded";
+	} else if (s->cfg.max_queued && !s->cfg.per_core &&
+		   atomic_load_explicit(&s->queued, memory_order_relaxed) >=
+			   s->cfg.max_queued) {
+		return "server busy";
+	}
+	return NULL;
+}
+
+// parses and queues a request read from the connection
+static void handle_request(struct loop *l, struct conn *c,
+			   struct ipc_request *r)
+{
+	int n = r->len;
+	int fdn = r->fdn;
+	r->conn = c;
+	r->loop = l;
+	r->read_ns = monotonic_ns();
+	SIPC_PROBE(parse_start, r, n, fdn);
+	c->inflight++;
+	l->inflight++;
+	atomic_fetch_add_explicit(&l->requests, 1, memory_order_relaxed);
+
+	const char *verb;
+	int verbn;
+	uint64_t id = 0;
+	double secs = 0;
+	int tagged = -1;
+	int deadline = 0;
+	const char *shed;
+	if (sipc_init(&r->args, r->buf, n) ||
+	    (tagged = sipc_request_id(&r->args, &id)) < 0 ||
+	    (deadline = sipc_deadline(&r->args, &secs)) < 0 ||
+	    sipc_start(&r->args) != SIPC_REQUEST ||
+	    sipc_string(&r->args, &verbn, &verb)) {
+		r->tagged = tagged > 0;
+		r->id = id;
+		r->seq = c->next_seq++;
+		// reply and then close the connection
+		c->read_closed = true;
+		ipc_error(r, "malformed", NULL);
+		return;
+	}
+
+	r->tagged = tagged > 0;
+	r->id = id;
+	if (!r->tagged) {
+		r->seq = c->next_seq++;
+	}
+
+	if (deadline) {
+		if (!(secs < MAX_DEADLINE_SECS)) {
+			secs = MAX_DEADLINE_SECS;
+		}
+		// keep clear of zero, which means no deadline
+		r->deadline = (monotonic_ns() + (long long)(secs * 1e9)) | 1;
+	}
+
+	r->h = find_handler(l->srv, verb, verbn);
+	r->parsed_ns = monotonic_ns();
+	SIPC_PROBE(parse_end, r, verb, verbn);
+	if (r->h && (r->h->cached || r->h->coalesced) && !fdn) {
+		r->keyoff = cache_key(r->buf, n, &r->idlen);
+		r->cacheable = r->keyoff >= 0 && r->h->cached && l->srv->cache;
+		r->gen = atomic_load(&r->h->gen);
+	} else {
+		r->keyoff = -1;
+	}
+	if (!r->h) {
+		ipc_error(r, "unknown", "unknown verb");
+	} else if (ipc_request_expired(r)) {
+		time_out(r);
+	} else if ((shed = admit(l, c)) != NULL) {
+		atomic_fetch_add_explicit(&l->shed, 1, memory_order_relaxed);
+		ipc_error(r, "overloaded", shed);
+	} else if (r->h->coalesced && r->keyoff >= 0 &&
+		   flight_join(l->srv, r)) {
+		// completed along with the leader
+		atomic_fetch_add_explicit(&l->coalesced, 1,
+					  memory_order_relaxed);
+	} else if (l->srv->cfg.per_core) {
+		// run once everything readable has been read (see run_ready)
+		int p = r->h->prio;
+		r->running = true;
+		c->running++;
+		r->next = NULL;
+		*l->ready_tail[p] = r;
+		l->ready_tail[p] = &r->next;
+	} else {
+		r->running = true;
+		c->running++;
+		dispatch(l, r);
+	}
+}
+
+static void handle_message(struct loop *l, struct conn *c, const char *buf,
+			   int n, const int *fds, int fdn)
+{
+	if (l->srv->cache && !fdn && cache_reply(l, c, buf, n)) {
+		return;
+	}
+	struct ipc_request *r = malloc(sizeof(*r) + n);
+	if (!r) {
+		for (int i = 0; i < fdn; i++) {
+			close(fds[i]);
+		}
+		c->dead = true;
+		return;
+	}
+	memset(r, 0, sizeof(*r));
+	r->len = n;
+	memcpy(r->buf, buf, n);
+	r->fdn = fdn;
+	memcpy(r->fds, fds, fdn * sizeof(*fds));
+	handle_request(l, c, r);
+}
+
+static void handle_readable(struct loop *l, struct conn *c)
+{
+	for (int i = 0; i < RECV_BATCH && !c->read_closed && !c->dead; i++) {
+		int fds[SERVER_MAX_FDS];
+		int fdn = SERVER_MAX_FDS;
+		int n = ipc_unix_recvmsg(c->fd, l->buf, SERVER_BUFSZ, fds,
+					 &fdn);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			c->read_closed = true;
+			break;
+		}
+		handle_message(l, c, l->buf, n, fds, fdn);
+	}
+}
+
+///////////////////////////////
+// Timers
+
+// next is the first tick that hasn't run yet
+static struct ipc_request **wheel_slot(struct wheel *w, long long expires,
+				       long long next)
+{
+	long long delta = expires - next;
+	if (delta < 0) {
+		return &w->l0[next & 255];
+	} else if (delta < 256) {
+		return &w->l0[expires & 255];
+	} else if (delta < 256 * 64) {
+		return &w->l1[(expires >> 8) & 63];
+	} else if (delta >= 256 * 64 * 64) {
+		// re-filed when the slot cascades
+		expires = next + 256 * 64 * 64 - 1;
+	}
+	return &w->l2[(expires >> 14) & 63];
+}
+
+static void timer_link(struct wheel *w, struct ipc_request *r, long long next)
+{
+	struct ipc_request **slot = wheel_slot(w, r->expires_ms, next);
+	r->tnext = *slot;
+	if (r->tnext) {
+		r->tnext->tpprev = &r->tnext;
+	}
+	r->tpprev = slot;
+	*slot = r;
+}
+
+static void timer_add(struct wheel *w, struct ipc_request *r)
+{
+	if (!w->count) {
+		w->now = monotonic_ns() / 1000000;
+	}
+	timer_link(w, r, w->now + 1);
+	w->count++;
+}
+
+static void timer_del(struct wheel *w, struct ipc_request *r)
+{
+	if (r->tpprev) {
+		*r->tpprev = r->tnext;
+		if (r->tnext) {
+			r->tnext->tpprev = r->tpprev;
+		}
+		r->tpprev = NULL;
+		w->count--;
+	}
+}
+
+// re-files a slot's timers on reaching it, before the tick's level 0 slot
+// runs
+static void cascade(struct wheel *w, struct ipc_request **slot)
+{
+	struct ipc_request *r = *slot;
+	*slot = NULL;
+	while (r) {
+		struct ipc_request *next = r->tnext;
+		timer_link(w, r, w->now);
+		r = next;
+	}
+}
+
+// Replies with a timeout in place of a request still sitting in a worker
+// queue. The worker frees the original when it gets to it.
+static void expire(struct loop *l, struct ipc_request *r)
+{
+	struct ipc_request *t = calloc(1, sizeof(*t));
+	int queued = REQ_QUEUED;
+	if (!t) {
+		return;
+	} else if (!atomic_compare_exchange_strong(&r->state, &queued,
+						   REQ_EXPIRED)) {
+		free(t);
+		return;
+	}
+	t->conn = r->conn;
+	t->loop = l;
+	t->seq = r->seq;
+	t->id = r->id;
+	t->tagged = r->tagged;
+	t->conn->inflight++;
+	l->inflight++;
+	ipc_error(t, "timeout", "deadline exceeded");
+}
+
+// Advances the wheel to now
+// returns the timers that have come due, linked through tnext
+static struct ipc_request *wheel_expire(struct wheel *w, long long now)
+{
+	struct ipc_request *due = NULL;
+	struct ipc_request **tail = &due;
+	while (w->count && w->now < now) {
+		w->now++;
+		if (!(w->now & 255)) {
+			if (!(w->now & 16383)) {
+				cascade(w, &w->l2[(w->now >> 14) & 63]);
+			}
+			cascade(w, &w->l1[(w->now >> 8) & 63]);
+		}
+		struct ipc_request **slot = &w->l0[w->now & 255];
+		while (*slot) {
+			struct ipc_request *r = *slot;
+			timer_del(w, r);
+			r->tnext = NULL;
+			*tail = r;
+			tail = &r->tnext;
+		}
+	}
+	return due;
+}
+
+static void wheel_advance(struct loop *l)
+{
+	struct ipc_request *r =
+		wheel_expire(&l->wheel, monotonic_ns() / 1000000);
+	while (r) {
+		struct ipc_request *next = r->tnext;
+		expire(l, r);
+		r = next;
+	}
+}
+
+// returns the epoll timeout until the next tick with timers due
+static int wheel_timeout(struct wheel *w)
+{
+	if (!w->count) {
+		return -1;
+	}
+	int ms = 1;
+	while (!w->l0[(w->now + ms) & 255] && ((w->now + ms) & 255)) {
+		ms++;
+	}
+	return ms;
+}
+
+///////////////////////////////
+// Pub/sub
+
+// An event formatted once and shared by the queues of all subscribers
+struct event {
+	atomic_int ref;
+	int len;
+	char *buf;
+	// one per loop, used to hand the event to loops with subscribers
+	struct pubitem *items;
+};
+
+struct pubitem {
+	struct pubitem *next;
+	struct ipc_topic *topic;
+	struct event *ev;
+};
+
+struct sub {
+	// in the topic's list for the loop
+	struct sub *next;
+	struct sub **pprev;
+	// in the connection's list
+	struct sub *cnext;
+	struct ipc_topic *topic;
+	// the subscription request, kept open while subscribed
+	struct ipc_request *r;
+	char hdr[48];
+	int hdrlen;
+	// events waiting to be sent
+	struct event **q;
+	unsigned head;
+	unsigned tail;
+};
+
+struct ipc_topic {
+	struct ipc_topic *next;
+	struct ipc_server *srv;
+	enum ipc_topic_policy policy;
+	unsigned mask;
+	// subscribers on each loop, only touched by that loop
+	struct sub **subs;
+	atomic_int *nsubs;
+	atomic_ulong published;
+	atomic_ulong dropped;
+};
+
+static void event_release(struct event *ev)
+{
+	if (atomic_fetch_sub(&ev->ref, 1) == 1) {
+		free(ev);
+	}
+}
+
+static void sub_flush(struct sub *sub);
+
+static void sub_push(struct loop *l, struct sub *sub, struct event *ev)
+{
+	struct ipc_topic *t = sub->topic;
+	struct conn *c = sub->r->conn;
+	atomic_fetch_add(&ev->ref, 1);
+	if (sub->tail - sub->head > t->mask && !c->subs_blocked) {
+		// only a subscriber the socket can't keep up with loses events,
+		// not one that received a burst within a single loop iteration
+		sub_flush(sub);
+	}
+	if (sub->tail - sub->head > t->mask) {
+		atomic_fetch_add_explicit(&t->dropped, 1, memory_order_relaxed);
+		if (t->policy == IPC_TOPIC_DROP) {
+			event_release(ev);
+			return;
+		}
+		// replace the newest, the subscriber still ends up on the
+		// latest event
+		struct event **slot = &sub->q[(sub->tail - 1) & t->mask];
+		event_release(*slot);
+		*slot = ev;
+	} else {
+		sub->q[sub->tail++ & t->mask] = ev;
+	}
+	if (!c->dirty) {
+		c->dirty = true;
+		c->dnext = l->dirty;
+		l->dirty = c;
+	}
+}
+
+// sends queued events in batches of SUB_BATCH messages per syscall
+static void sub_flush(struct sub *sub)
+{
+	struct conn *c = sub->r->conn;
+	unsigned mask = sub->topic->mask;
+	while (sub->head != sub->tail && !c->dead) {
+		struct mmsghdr msgs[SUB_BATCH];
+		struct iovec iov[SUB_BATCH][2];
+		int n = 0;
+		for (unsigned i = sub->head; i != sub->tail && n < SUB_BATCH;
+		     i++, n++) {
+			struct event *ev = sub->q[i & mask];
+			iov[n][0].iov_base = sub->hdr;
+			iov[n][0].iov_len = sub->hdrlen;
+			iov[n][1].iov_base = ev->buf;
+			iov[n][1].iov_len = ev->len;
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_iov = iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 2;
+		}
+		int sent = sendmmsg(c->fd, msgs, n, MSG_NOSIGNAL);
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			c->subs_blocked = true;
+			c->want_write = true;
+			return;
+		} else if (sent < 0 && errno != EINTR) {
+			c->dead = true;
+			return;
+		}
+		for (int i = 0; i < sent; i++) {
+			event_release(sub->q[sub->head++ & mask]);
+		}
+	}
+}
+
+static void conn_flush_subs(struct conn *c)
+{
+	c->subs_blocked = false;
+	for (struct sub *sub = c->subs; sub != NULL; sub = sub->cnext) {
+		sub_flush(sub);
+	}
+}
+
+// sends the events queued since the last call, once per connection
+static void flush_dirty(struct loop *l)
+{
+	struct conn *c = l->dirty;
+	l->dirty = NULL;
+	while (c) {
+		struct conn *next = c->dnext;
+		c->dirty = false;
+		if (!c->freed) {
+			conn_flush_subs(c);
+			conn_check(c);
+		}
+		c = next;
+	}
+}
+
+static void add_sub(struct loop *l, struct sub *sub)
+{
+	struct conn *c = sub->r->conn;
+	struct ipc_topic *t = sub->topic;
+	if (c->read_closed) {
+		struct ipc_request *r = sub->r;
+		free(sub->q);
+		free(sub);
+		ipc_reply(r, "S\n");
+		return;
+	}
+	sub->next = t->subs[l->idx];
+	if (sub->next) {
+		sub->next->pprev = &sub->next;
+	}
+	sub->pprev = &t->subs[l->idx];
+	*sub->pprev = sub;
+	sub->cnext = c->subs;
+	c->subs = sub;
+	atomic_fetch_add(&t->nsubs[l->idx], 1);
+}
+
+// completes the subscriptions of a connection that is going away
+static void end_subs(struct conn *c)
+{
+	struct loop *l = c->loop;
+	while (c->subs) {
+		struct sub *sub = c->subs;
+		c->subs = sub->cnext;
+		*sub->pprev = sub->next;
+		if (sub->next) {
+			sub->next->pprev = sub->pprev;
+		}
+		atomic_fetch_sub(&sub->topic->nsubs[l->idx], 1);
+		while (sub->head != sub->tail) {
+			event_release(sub->q[sub->head++ & sub->topic->mask]);
+		}
+		struct ipc_request *r = sub->r;
+		free(sub->q);
+		free(sub);
+		ipc_reply(r, "S\n");
+	}
+}
+
+static void deliver(struct loop *l, struct pubitem *it)
+{
+	struct sub *sub = it->topic->subs[l->idx];
+	while (sub) {
+		sub_push(l, sub, it->ev);
+		sub = sub->next;
+	}
+	event_release(it->ev);
+}
+
+static void drain_subs(struct loop *l)
+{
+	struct sub *sub = atomic_exchange(&l->newsubs, NULL);
+	while (sub) {
+		struct sub *next = sub->next;
+		add_sub(l, sub);
+		sub = next;
+	}
+}
+
+static void drain_pubs(struct loop *l)
+{
+	// newest first, keep events in publish order
+	struct pubitem *it = atomic_exchange(&l->pubs, NULL);
+	struct pubitem *fifo = NULL;
+	while (it) {
+		struct pubitem *next = it->next;
+		it->next = fifo;
+		fifo = it;
+		it = next;
+	}
+	while (fifo) {
+		struct pubitem *next = fifo->next;
+		deliver(l, fifo);
+		fifo = next;
+	}
+}
+
+///////////////////////////////
+// Loops
+
+static void complete(struct ipc_request *r)
+{
+	struct loop *l = r->loop;
+	r->done_ns = monotonic_ns();
+	SIPC_PROBE(complete, r);
+	struct ipc_request *heir = r->leader ? flight_land(r) : NULL;
+	if (tls_loop == l) {
+		// completed on the loop thread itself
+		conn_complete(r->conn, r);
+	} else {
+		struct ipc_request *head = atomic_load(&l->done);
+		do {
+			r->next = head;
+		} while (!atomic_compare_exchange_weak(&l->done, &head, r));
+		if (!head) {
+			wake(l->efd);
+		}
+	}
+	if (heir) {
+		// Leaders only time out on a worker, or on a loop in
+		// thread-per-core mode, so this is a thread that runs handlers
+		run_handler(heir);
+	}
+}
+
+static struct bucket *client_bucket(struct ipc_server *s, int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		return &s->buckets[BUCKETS];
+	}
+	return find_bucket(s, s->cfg.rate_by_pid ? (long long)cred.pid :
+						   (long long)cred.uid);
+}
+
+static void drain_newconns(struct loop *l)
+{
+	struct newconn *nc = atomic_exchange(&l->newconns, NULL);
+	while (nc) {
+		struct newconn *next = nc->next;
+		struct conn *c = calloc(1, sizeof(*c));
+		if (!c && nc->local) {
+			atomic_store(&nc->local->closed, true);
+			wake(nc->local->efd);
+			local_release(nc->local);
+		} else if (!c) {
+			close(nc->fd);
+		} else {
+			c->loop = l;
+			c->fd = nc->fd;
+			c->local = nc->local;
+			if (c->local) {
+				c->local->conn = c;
+			} else if (l->srv->buckets) {
+				c->bucket = client_bucket(l->srv, c->fd);
+			}
+			c->outq_tail = &c->outq;
+			c->next = l->conns;
+			if (l->conns) {
+				l->conns->prev = c;
+			}
+			l->conns = c;
+			c->read_closed = atomic_load(&l->stop);
+			conn_check(c);
+		}
+		free(nc);
+		nc = next;
+	}
+}
+
+static void drain_local(struct loop *l)
+{
+	struct ipc_request *r = atomic_exchange(&l->localreqs, NULL);
+	// the connection was queued before any of its requests
+	drain_newconns(l);
+	struct ipc_request *fifo = NULL;
+	while (r) {
+		struct ipc_request *next = r->next;
+		r->next = fifo;
+		fifo = r;
+		r = next;
+	}
+	while (fifo) {
+		struct ipc_request *next = fifo->next;
+		struct conn *c = fifo->local->conn;
+		if (fifo == fifo->local->eof) {
+			// ipc_local_close, after the requests sent before it.
+			// Nothing reads the replies any more, which would
+			// leave handlers waiting on their parts.
+			struct ipc_local *lc = fifo->local;
+			if (c) {
+				c->dead = true;
+				conn_check(c);
+			}
+			local_drop(lc);
+			local_release(lc);
+		} else if (!c || c->read_closed) {
+			free_request(fifo);
+		} else if (!l->srv->cache || fifo->fdn ||
+			   !cache_reply(l, c, fifo->buf, fifo->len)) {
+			handle_request(l, c, fifo);
+		} else {
+			free(fifo);
+		}
+		fifo = next;
+	}
+}
+
+static void drain_done(struct loop *l)
+{
+	// the stack is newest first, keep each thread's completions (e.g.
+	// partial replies) in order
+	struct ipc_request *r = atomic_exchange(&l->done, NULL);
+	struct ipc_request *fifo = NULL;
+	while (r) {
+		struct ipc_request *next = r->next;
+		r->next = fifo;
+		fifo = r;
+		r = next;
+	}
+	r = fifo;
+	while (r) {
+		struct ipc_request *next = r->next;
+		struct conn *c = r->conn;
+		conn_complete(c, r);
+		conn_check(c);
+		r = next;
+	}
+}
+
+// Runs requests read in thread-per-core mode in priority order, so that
+// high priority requests overtake ones read before them in the same batch.
+static void run_ready(struct loop *l)
+{
+	for (;;) {
+		unsigned mask = 0;
+		for (int p = 0; p < IPC_PRIORITIES; p++) {
+			if (l->ready[p]) {
+				mask |= 1u << p;
+			}
+		}
+		if (!mask) {
+			return;
+		}
+		int p = pick_class(l->srv, l->credit, mask);
+		struct ipc_request *r = l->ready[p];
+		l->ready[p] = r->next;
+		if (!r->next) {
+			l->ready_tail[p] = &l->ready[p];
+		}
+
+		struct conn *c = r->conn;
+		if (ipc_request_expired(r)) {
+			time_out(r);
+		} else {
+			run_handler(r);
+		}
+		conn_check(c);
+	}
+}
+
+static int loop_wait(struct loop *l, struct epoll_event *evs, int n)
+{
+	int timeout = wheel_timeout(&l->wheel);
+	long budget = l->srv->cfg.spin_ns;
+	if (budget > 0) {
+		long long start = monotonic_ns();
+		do {
+			int r = epoll_wait(l->epfd, evs, n, 0);
+			if (r) {
+				return r;
+			}
+			cpu_relax();
+		} while (monotonic_ns() - start < budget);
+	}
+	return epoll_wait(l->epfd, evs, n, timeout);
+}
+
+static void loop_quiesce(struct loop *l)
+{
+	// stop reading new requests, but keep going until the outstanding
+	// ones have been replied to
+	for (struct conn *c = l->conns; c != NULL;) {
+		struct conn *next = c->next;
+		c->read_closed = true;
+		conn_check(c);
+		c = next;
+	}
+}
+
+// closes the connections of a batch the handover thread has sent, the
+// successor has a copy
+static void handoff_sent(struct loop *l)
+{
+	for (int i = 0; i < l->handoffn; i++) {
+		l->handoff[i]->read_closed = true;
+		conn_check(l->handoff[i]);
+	}
+	l->handoffn = 0;
+	l->handoff_state = HANDOFF_IDLE;
+}
+
+// Hands the loop's connections to the successor as soon as they have no
+// requests outstanding, a batch at a time through the handover thread.
+// Unread requests stay queued on the socket and are read by the successor.
+// Subscriptions are ended so that clients resubscribe there.
+static void migrate(struct loop *l)
+{
+	struct ipc_server *s = l->srv;
+	// connections handed out by the accept thread before it stopped
+	drain_newconns(l);
+	mtx_lock(&s->handover_lk);
+	if (!atomic_load(&l->handover)) {
+		// the handover failed meanwhile (see resume)
+		mtx_unlock(&s->handover_lk);
+		return;
+	}
+	struct ipc_request *hr = atomic_load(&s->handover);
+	if (!l->draining) {
+		l->draining = true;
+		for (struct conn *c = l->conns; c != NULL; c = c->next) {
+			conn_update_events(c);
+		}
+	}
+	if (l->handoff_state == HANDOFF_SENT) {
+		handoff_sent(l);
+	} else if (l->handoff_state != HANDOFF_IDLE) {
+		mtx_unlock(&s->handover_lk);
+		return;
+	}
+
+	bool busy = false;
+	for (struct conn *c = l->conns; c != NULL; c = c->next) {
+		// in-process connections stay with the process
+		if (c == hr->conn || c->local) {
+			continue;
+		}
+		if (c->subs) {
+			end_subs(c);
+		}
+		if (c->inflight) {
+			busy = true;
+		} else if (l->handoffn < SERVER_MAX_FDS) {
+			l->handoff[l->handoffn++] = c;
+		}
+	}
+	if (l->handoffn) {
+		l->handoff_state = HANDOFF_QUEUED;
+		wake(s->handover_efd);
+	} else if (!busy) {
+		l->drained = true;
+		atomic_fetch_sub(&s->handover_loops, 1);
+		wake(s->handover_efd);
+	}
+	mtx_unlock(&s->handover_lk);
+}
+
+// Takes the loop's connections back once a handover has failed. Those in a
+// batch that was sent are gone with the successor.
+static void resume(struct loop *l)
+{
+	struct ipc_server *s = l->srv;
+	mtx_lock(&s->handover_lk);
+	if (atomic_load(&l->handover)) {
+		// another successor came along before the loop got here
+		mtx_unlock(&s->handover_lk);
+		return;
+	}
+	if (l->handoff_state == HANDOFF_SENT) {
+		handoff_sent(l);
+	}
+	l->handoffn = 0;
+	l->handoff_state = HANDOFF_IDLE;
+	if (l->drained) {
+		atomic_fetch_add(&s->handover_loops, 1);
+	}
+	l->draining = false;
+	l->drained = false;
+	mtx_unlock(&s->handover_lk);
+	for (struct conn *c = l->conns; c != NULL; c = c->next) {
+		conn_update_events(c);
+	}
+}
+
+static int loop_thread(void *arg)
+{
+	struct loop *l = arg;
+	tls_loop = l;
+	pin_thread(l->srv, false, l->idx);
+	for (int p = 0; p < IPC_PRIORITIES; p++) {
+		l->ready_tail[p] = &l->ready[p];
+	}
+
+	unsigned cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL)) {
+		cpu = node = -1;
+	}
+	atomic_store(&l->cpu, (int)cpu);
+	atomic_store(&l->node, (int)node);
+	touch_local(l->buf, SERVER_BUFSZ, (int)node);
+	if (l->srv->cfg.per_core) {
+		core_start(l->srv, l->idx);
+	}
+
+	bool stopping = false;
+	struct epoll_event evs[EVENT_BATCH];
+	while (!stopping || l->inflight) {
+		int n = loop_wait(l, evs, EVENT_BATCH);
+		for (int i = 0; i < n; i++) {
+			struct conn *c = evs[i].data.ptr;
+			if (!c) {
+				uint64_t v;
+				read(l->efd, &v, sizeof(v));
+				drain_newconns(l);
+				drain_local(l);
+				drain_done(l);
+				drain_subs(l);
+				drain_pubs(l);
+				continue;
+			} else if (c->freed) {
+				continue;
+			}
+			if ((evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+			    !l->draining) {
+				handle_readable(l, c);
+			}
+			if (evs[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+				if (c->subs_blocked) {
+					conn_flush_subs(c);
+				}
+				conn_flush(c);
+			}
+			conn_check(c);
+		}
+
+		run_ready(l);
+		flush_dirty(l);
+		wheel_advance(l);
+		if (atomic_load_explicit(&l->handover, memory_order_relaxed)) {
+			if (!l->drained) {
+				migrate(l);
+			}
+		} else if (l->draining) {
+			resume(l);
+		}
+
+		while (l->dead) {
+			struct conn *next = l->dead->next;
+			free(l->dead);
+			l->dead = next;
+		}
+
+		if (!stopping && atomic_load(&l->stop)) {
+			stopping = true;
+			loop_quiesce(l);
+		}
+	}
+
+	while (l->dead) {
+		struct conn *next = l->dead->next;
+		free(l->dead);
+		l->dead = next;
+	}
+	if (l->srv->cfg.per_core) {
+		core_stop(l->srv);
+	}
+	return 0;
+}
+
+static struct loop *pick_loop(struct ipc_server *s)
+{
+	if (s->cfg.balance == IPC_LEAST_LOADED) {
+		struct loop *best = &s->loops[0];
+		int min = atomic_load(&best->nconns);
+		for (int i = 1; i < s->loopn; i++) {
+			int n = atomic_load(&s->loops[i].nconns);
+			if (n < min) {
+				best = &s->loops[i];
+				min = n;
+			}
+		}
+		return best;
+	}
+	unsigned idx = atomic_fetch_add(&s->next_loop, 1) % s->loopn;
+	return &s->loops[idx];
+}
+
+// hands a connected socket to one of the loops
+static void push_newconn(struct loop *l, struct newconn *nc)
+{
+	atomic_fetch_add(&l->nconns, 1);
+	struct newconn *head = atomic_load(&l->newconns);
+	do {
+		nc->next = head;
+	} while (!atomic_compare_exchange_weak(&l->newconns, &head, nc));
+	if (!head) {
+		wake(l->efd);
+	}
+}
+
+static void hand_conn(struct ipc_server *s, int fd)
+{
+	struct newconn *nc = malloc(sizeof(*nc));
+	if (!nc) {
+		close(fd);
+		return;
+	}
+	nc->fd = fd;
+	nc->local = NULL;
+	struct loop *l = pick_loop(s);
+	atomic_fetch_add_explicit(&l->accepted, 1, memory_order_relaxed);
+	push_newconn(l, nc);
+}
+
+static int accept_thread(void *arg)
+{
+	struct ipc_server *s = arg;
+	for (;;) {
+		// The listening socket may be shared with a predecessor or
+		// successor (see ipc_server_config.handover), so it is never
+		// shut down and another process may take a connection first.
+		struct pollfd pfd[2] = {
+			{ .fd = s->lfd, .events = POLLIN },
+			{ .fd = s->accept_efd, .events = POLLIN },
+		};
+		poll(pfd, 2, -1);
+		if (atomic_load(&s->stopping)) {
+			return 0;
+		} else if (atomic_load(&s->handing_over)) {
+			// Anything accepted so far has been handed to a loop
+			// before it sees this.
+			for (int i = 0; i < s->loopn; i++) {
+				atomic_store(&s->loops[i].handover, true);
+				wake(s->loops[i].efd);
+			}
+			return 0;
+		}
+		int fd = accept4(s->lfd, NULL, NULL,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0 && (errno == EINTR || errno == ECONNABORTED ||
+			       errno == EAGAIN || errno == EWOULDBLOCK)) {
+			continue;
+		} else if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+			// wait for connections to close
+			struct timespec ts = { .tv_nsec = 10 * 1000000 };
+			thrd_sleep(&ts, NULL);
+			continue;
+		} else if (fd < 0) {
+			return -1;
+		}
+		hand_conn(s, fd);
+	}
+}
+
+// Sends a part of the reply to the handover request straight to the
+// successor, waiting for room on the socket if need be. The loop owning the
+// connection has nothing else to send on it.
+// returns zero on success
+static int handover_send(struct ipc_server *s, struct ipc_request *hr,
+			 const char *kind, const int *fds, int fdn)
+{
+	char buf[64];
+	int n = 0;
+	if (hr->tagged) {
+		n = sipc_format(buf, sizeof(buf), "I %llu\n",
+				(unsigned long long)hr->id);
+	}
+	n += sipc_format(buf + n, sizeof(buf) - n, "P %s\n", kind);
+	int fd = hr->conn->fd;
+	while (!atomic_load(&s->stopping)) {
+		if (ipc_unix_sendmsg(fd, buf, n, fds, fdn) == n) {
+			return 0;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			   errno != EINTR) {
+			return -1;
+		}
+		struct pollfd pfd[2] = {
+			{ .fd = fd, .events = POLLOUT },
+			{ .fd = s->handover_efd, .events = POLLIN },
+		};
+		poll(pfd, 2, -1);
+		if (pfd[0].revents & (POLLHUP | POLLERR)) {
+			return -1;
+		} else if (pfd[1].revents) {
+			uint64_t v;
+			read(s->handover_efd, &v, sizeof(v));
+		}
+	}
+	return -1;
+}
+
+// Sends the batches of connections queued by the loops (see migrate)
+// returns zero on success
+static int handover_batches(struct ipc_server *s, struct ipc_request *hr)
+{
+	int ret = 0;
+	for (int i = 0; i < s->loopn; i++) {
+		struct loop *l = &s->loops[i];
+		mtx_lock(&s->handover_lk);
+		bool queued = l->handoff_state == HANDOFF_QUEUED;
+		if (queued) {
+			l->handoff_state = HANDOFF_SENDING;
+		}
+		mtx_unlock(&s->handover_lk);
+		if (!queued) {
+			continue;
+		}
+		int fds[SERVER_MAX_FDS];
+		for (int j = 0; j < l->handoffn; j++) {
+			fds[j] = l->handoff[j]->fd;
+		}
+		// once something has failed the rest stay with their loops
+		if (!ret) {
+			ret = handover_send(s, hr, "conn", fds, l->handoffn);
+		}
+		mtx_lock(&s->handover_lk);
+		l->handoff_state = ret ? HANDOFF_IDLE : HANDOFF_SENT;
+		mtx_unlock(&s->handover_lk);
+		wake(l->efd);
+	}
+	return ret;
+}
+
+// Gives up on a successor. The server keeps the listening socket and the
+// connections that weren't sent and goes on as before.
+static void handover_fail(struct ipc_server *s, struct ipc_request *hr)
+{
+	bool stopping = atomic_load(&s->stopping);
+	if (atomic_load(&s->handing_over) && !stopping) {
+		// the accept thread exits once it has told the loops
+		thrd_join(s->accept_thread, NULL);
+		s->accepting = false;
+	}
+	mtx_lock(&s->handover_lk);
+	for (int i = 0; i < s->loopn; i++) {
+		struct loop *l = &s->loops[i];
+		if (l->handoff_state == HANDOFF_QUEUED) {
+			l->handoff_state = HANDOFF_IDLE;
+		}
+		atomic_store(&l->handover, false);
+		wake(l->efd);
+	}
+	mtx_unlock(&s->handover_lk);
+	if (!s->accepting && !stopping) {
+		uint64_t v;
+		read(s->accept_efd, &v, sizeof(v));
+		atomic_store(&s->handing_over, false);
+		// ipc_server_stop joins it if it has set stopping since
+		s->accepting = thrd_create(&s->accept_thread, &accept_thread,
+					   s) == thrd_success;
+	}
+	// r is freed once completed, let another successor try
+	atomic_store(&s->handover, NULL);
+	ipc_error(hr, "unavailable", "handover failed");
+}
+
+// Runs a handover claimed by handover_handler, watching the successor's
+// connection throughout so that a successor going away doesn't leave the
+// server without an accept thread or its connections
+// returns zero once everything has been handed over
+static int hand_over(struct ipc_server *s, struct ipc_request *hr)
+{
+	if (handover_send(s, hr, "listen", &s->lfd, 1)) {
+		handover_fail(s, hr);
+		return -1;
+	}
+	atomic_store(&s->handing_over, true);
+	wake(s->accept_efd);
+	for (;;) {
+		if (handover_batches(s, hr)) {
+			break;
+		} else if (!atomic_load(&s->handover_loops)) {
+			ipc_reply(hr, "S\n");
+			mtx_lock(&s->idle_lk);
+			s->handed_over = true;
+			cnd_broadcast(&s->handed_cv);
+			mtx_unlock(&s->idle_lk);
+			return 0;
+		}
+		struct pollfd pfd[2] = {
+			{ .fd = hr->conn->fd, .events = POLLRDHUP },
+			{ .fd = s->handover_efd, .events = POLLIN },
+		};
+		poll(pfd, 2, -1);
+		if (pfd[1].revents) {
+			uint64_t v;
+			read(s->handover_efd, &v, sizeof(v));
+		}
+		if (atomic_load(&s->stopping) ||
+		    (pfd[0].revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+			break;
+		}
+	}
+	handover_fail(s, hr);
+	return -1;
+}
+
+static int handover_thread(void *arg)
+{
+	struct ipc_server *s = arg;
+	for (;;) {
+		struct pollfd pfd = { .fd = s->handover_efd, .events = POLLIN };
+		poll(&pfd, 1, -1);
+		uint64_t v;
+		read(s->handover_efd, &v, sizeof(v));
+		if (atomic_load(&s->stopping)) {
+			return 0;
+		}
+		struct ipc_request *hr = atomic_load(&s->handover);
+		if (hr && !hand_over(s, hr)) {
+			return 0;
+		}
+	}
+}
+
+// whether the other end of a connection has closed or shut down
+static bool peer_closed(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLRDHUP };
+	return poll(&pfd, 1, 0) > 0 &&
+	       (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+// Gives the listening socket to a successor started with
+// ipc_server_start_path and then migrates the connections (see migrate).
+// The handover thread does the sending so that neither this handler nor the
+// loops wait on the successor.
+static void handover_handler(void *udata, struct ipc_request *r,
+			     sipc_parser_t *args)
+{
+	struct ipc_server *s = udata;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	struct ipc_request *none = NULL;
+	if (getsockopt(r->conn->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+	    cred.uid != geteuid()) {
+		ipc_error(r, "denied", "handover from another user");
+	} else if (peer_closed(r->conn->fd)) {
+		// there would be no one to take the connections
+		ipc_error(r, "unavailable", "successor went away");
+	} else if (!atomic_compare_exchange_strong(&s->handover, &none, r)) {
+		ipc_error(r, "busy", "already handing over");
+	} else {
+		wake(s->handover_efd);
+	}
+}
+
+// Takes over from a running server on the other end of fd
+// returns zero on success, -ve on error or +ve if the other end won't hand
+// over
+static int takeover(struct ipc_server *s, int fd)
+{
+	static const char req[] = "I 1\nR 8:handover\n";
+	int reqn = (int)sizeof(req) - 1;
+	if (ipc_unix_sendmsg(fd, req, reqn, NULL, 0) != reqn) {
+		return 1;
+	}
+	bool started = false;
+	for (;;) {
+		char buf[256];
+		int fds[SERVER_MAX_FDS];
+		int fdn = SERVER_MAX_FDS;
+		int n = ipc_unix_recvmsg(fd, buf, sizeof(buf), fds, &fdn);
+		if (n <= 0) {
+			break;
+		}
+		sipc_parser_t p;
+		uint64_t id;
+		const char *kind = "";
+		int kindn = 0;
+		if (sipc_init(&p, buf, n) || sipc_request_id(&p, &id) < 0 ||
+		    sipc_start(&p) != SIPC_PART ||
+		    sipc_string(&p, &kindn, &kind)) {
+			// the final reply, or an error before anything was
+			// handed over
+			kindn = 0;
+		}
+		for (int i = 0; i < fdn; i++) {
+			if (kindn == 6 && !memcmp(kind, "listen", 6) &&
+			    !started && i == 0) {
+				started = true;
+				if (ipc_server_start(s, fds[i])) {
+					return -1;
+				}
+			} else if (kindn == 4 && !memcmp(kind, "conn", 4) &&
+				   started) {
+				fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+				fcntl(fds[i], F_SETFL,
+				      fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+				hand_conn(s, fds[i]);
+			} else {
+				close(fds[i]);
+			}
+		}
+		if (!kindn) {
+			break;
+		}
+	}
+	return started ? 0 : 1;
+}
+
+///////////////////////////////
+// Slow request log
+
+static void write_all(int fd, const char *buf, int n)
+{
+	while (n > 0) {
+		ssize_t w = write(fd, buf, n);
+		if (w < 0 && errno == EINTR) {
+			continue;
+		} else if (w <= 0) {
+			// nowhere to report it, the entries are lost
+			return;
+		}
+		buf += w;
+		n -= (int)w;
+	}
+}
+
+// formats monotonic ns as UTC wall clock time
+static int slow_time(char *buf, int sz, long long ns, long long offset)
+{
+	ns += offset;
+	time_t secs = (time_t)(ns / 1000000000);
+	struct tm tm;
+	gmtime_r(&secs, &tm);
+	int n = (int)strftime(buf, sz, "%Y-%m-%dT%H:%M:%S", &tm);
+	return n + snprintf(buf + n, sz - n, ".%06lldZ",
+			    ns % 1000000000 / 1000);
+}
+
+// One line per request, with the same phases as the stats verb. Requests
+// that never reached a handler count the time to their reply as queued.
+static int slow_format(char *buf, int sz, const struct slow_entry *e,
+		       long long offset)
+{
+	long long done = e->done_ns ? e->done_ns : e->sent_ns;
+	long long start = e->start_ns ? e->start_ns : done;
+	int n = slow_time(buf, sz, e->read_ns, offset);
+	n += snprintf(buf + n, sz - n,
+		      " verb=%.*s total_ns=%lld parse_ns=%lld queue_ns=%lld"
+		      " handler_ns=%lld send_ns=%lld request_bytes=%d"
+		      " request_fds=%d reply_bytes=%d reply_fds=%d error=%d\n",
+		      e->verbn, e->verb, e->sent_ns - e->read_ns,
+		      e->parsed_ns - e->read_ns, start - e->parsed_ns,
+		      done - start, e->sent_ns - done, e->len, e->fdn,
+		      e->replylen, e->replyfdn, e->failed);
+	return n;
+}
+
+static void slow_drain(struct ipc_server *s)
+{
+	char buf[16384];
+	int n = 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	long long now = monotonic_ns();
+	long long offset =
+		(long long)ts.tv_sec * 1000000000 + ts.tv_nsec - now;
+	for (int i = 0; i < s->loopn; i++) {
+		struct slow_ring *q = s->loops[i].slow;
+		unsigned head =
+			atomic_load_explicit(&q->head, memory_order_relaxed);
+		unsigned tail =
+			atomic_load_explicit(&q->tail, memory_order_acquire);
+		for (; head != tail; head++) {
+			if (n > (int)sizeof(buf) - 512) {
+				write_all(s->slow_fd, buf, n);
+				n = 0;
+			}
+			n += slow_format(buf + n, sizeof(buf) - n,
+					 &q->entries[head % SLOW_RING], offset);
+			atomic_store_explicit(&q->head, head + 1,
+					      memory_order_release);
+		}
+		unsigned long dropped = atomic_exchange_explicit(
+			&q->dropped, 0, memory_order_relaxed);
+		if (dropped) {
+			n += slow_time(buf + n, sizeof(buf) - n, now, offset);
+			n += snprintf(buf + n, sizeof(buf) - n,
+				      " dropped=%lu\n", dropped);
+		}
+	}
+	write_all(s->slow_fd, buf, n);
+}
+
+static int slow_thread(void *arg)
+{
+	struct ipc_server *s = arg;
+	// only run on otherwise idle CPUs, the rings absorb bursts
+	struct sched_param sp = { 0 };
+	sched_setscheduler(0, SCHED_IDLE, &sp);
+	for (;;) {
+		// the loops have queued their last entries once stopped
+		bool stop = atomic_load(&s->slow_stop);
+		slow_drain(s);
+		if (stop) {
+			return 0;
+		}
+		struct pollfd pfd = { .fd = s->slow_efd, .events = POLLIN };
+		poll(&pfd, 1, SLOW_DRAIN_MS);
+	}
+}
+
+///////////////////////////////
+// Public API
+
+static const char *const stat_names[STAT_KINDS] = {
+	"parse",
+	"queue",
+	"handler",
+	"send",
+};
+
+#define STATS_BUFSZ (SERVER_BUFSZ - 64)
+
+// returns the new length or -ve once the reply no longer fits
+static int stats_append(char *buf, int n, const char *fmt, ...)
+{
+	if (n < 0) {
+		return n;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	int m = sipc_vformat(buf + n, STATS_BUFSZ - n, fmt, ap);
+	va_end(ap);
+	return m < 0 || m >= STATS_BUFSZ - n ? -1 : n + m;
+}
+
+// The reserved stats verb, optionally for a single verb. Replies with a map
+// from verb to its counters and latency histograms merged across the I/O
+// threads. Each histogram maps the upper bound of a bucket in ns to its
+// count, leaving out empty buckets.
+static void stats_handler(void *udata, struct ipc_request *r,
+			  sipc_parser_t *args)
+{
+	struct ipc_server *s = udata;
+	const char *verb;
+	int verbn;
+	if (sipc_string(args, &verbn, &verb)) {
+		verb = NULL;
+	}
+	char *buf = malloc(STATS_BUFSZ);
+	if (!buf) {
+		ipc_error(r, "overloaded", "out of memory");
+		return;
+	}
+	int n = 0;
+	for (int h = 0; h < s->handlern; h++) {
+		const struct handler *hd = &s->handlers[h];
+		if (verb && (hd->verbn != verbn ||
+			     memcmp(hd->verb, verb, verbn))) {
+			continue;
+		}
+		unsigned long requests = 0, errors = 0;
+		unsigned long hist[STAT_KINDS][STAT_BUCKETS] = { 0 };
+		for (int i = 0; i < s->loopn; i++) {
+			struct verb_stats *vs = &s->loops[i].stats[h];
+			requests += atomic_load_explicit(&vs->requests,
+							 memory_order_relaxed);
+			errors += atomic_load_explicit(&vs->errors,
+						       memory_order_relaxed);
+			for (int k = 0; k < STAT_KINDS; k++) {
+				for (int b = 0; b < STAT_BUCKETS; b++) {
+					hist[k][b] += atomic_load_explicit(
+						&vs->hist[k][b],
+						memory_order_relaxed);
+				}
+			}
+		}
+		n = stats_append(buf, n, "%s { 8:requests %lu 6:errors %lu ",
+				 hd->verb, requests, errors);
+		for (int k = 0; k < STAT_KINDS; k++) {
+			n = stats_append(buf, n, "%s { ", stat_names[k]);
+			for (int b = 0; b < STAT_BUCKETS; b++) {
+				if (hist[k][b]) {
+					n = stats_append(buf, n, "%lli %lu ",
+							 ipc_hist_upper(b),
+							 hist[k][b]);
+				}
+			}
+			n = stats_append(buf, n, "} ");
+		}
+		n = stats_append(buf, n, "} ");
+	}
+	if (n < 0) {
+		ipc_error(r, "toolarge", "request the stats of a single verb");
+	} else {
+		ipc_reply(r, "S { %.*s}\n", n, buf);
+	}
+	free(buf);
+}
+
+struct ipc_server *ipc_server_new(const struct ipc_server_config *cfg)
+{
+	struct ipc_server *s = calloc(1, sizeof(*s));
+	if (!s) {
+		return NULL;
+	}
+	s->cfg = *cfg;
+	s->lfd = -1;
+	s->slow_fd = -1;
+	s->slow_efd = -1;
+	int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	s->loopn = cfg->per_core ? ncpu : 1;
+	if (cfg->io_threads > 0) {
+		s->loopn = cfg->io_threads;
+	}
+	s->workern = cfg->workers > 0 ? cfg->workers : ncpu;
+	s->cache_budget = cfg->cache_bytes;
+	if (cfg->per_core) {
+		s->workern = 0;
+	}
+	atomic_init(&s->stopping, false);
+	atomic_init(&s->next_loop, 0);
+	atomic_init(&s->queued, 0);
+	atomic_init(&s->sleepers, 0);
+	static const unsigned default_weights[IPC_PRIORITIES] = { 16, 4, 1 };
+	for (int p = 0; p < IPC_PRIORITIES; p++) {
+		atomic_init(&s->pqueued[p], 0);
+		s->weights[p] = cfg->weights[p] > 0 ? (unsigned)cfg->weights[p] :
+						      default_weights[p];
+	}
+	mtx_init(&s->idle_lk, mtx_plain);
+	cnd_init(&s->idle_cv);
+	cnd_init(&s->handed_cv);
+	atomic_init(&s->handover, NULL);
+	atomic_init(&s->handing_over, false);
+	mtx_init(&s->handover_lk, mtx_plain);
+	s->accept_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	s->handover_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	atomic_init(&s->slow_stop, false);
+	if (cfg->slow_ns > 0) {
+		s->slow_fd = !cfg->slow_log ? STDERR_FILENO :
+			     open(cfg->slow_log,
+				  O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+				  0644);
+		s->slow_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (s->slow_fd < 0 || s->slow_efd < 0) {
+			ipc_server_free(s);
+			return NULL;
+		}
+	}
+
+	if (cfg->io_cpus) {
+		s->io_cpun = parse_cpulist(cfg->io_cpus, &s->io_cpus);
+	}
+	if (cfg->worker_cpus) {
+		s->worker_cpun =
+			parse_cpulist(cfg->worker_cpus, &s->worker_cpus);
+	}
+	if (cfg->rate > 0) {
+		s->interval_ns = (long long)(1e9 / cfg->rate);
+		int burst = cfg->burst > 0 ? cfg->burst : (int)cfg->rate;
+		s->burst_ns = (burst > 1 ? burst : 1) * s->interval_ns;
+		s->buckets = calloc(BUCKETS + 1, sizeof(*s->buckets));
+		for (int i = 0; s->buckets && i <= BUCKETS; i++) {
+			atomic_init(&s->buckets[i].key, -1);
+			atomic_init(&s->buckets[i].tat, 0);
+		}
+	}
+	if (cfg->cache_bytes) {
+		s->cache = aligned_alloc(_Alignof(struct cache_shard),
+					 CACHE_SHARDS * sizeof(*s->cache));
+		for (int i = 0; s->cache && i < CACHE_SHARDS; i++) {
+			memset(&s->cache[i], 0, sizeof(s->cache[i]));
+			mtx_init(&s->cache[i].lk, mtx_plain);
+			s->cache[i].mask = 255;
+			s->cache[i].table = calloc(256, sizeof(struct cache_entry *));
+			if (!s->cache[i].table) {
+				s->cache_budget = 0;
+			}
+		}
+	}
+	if (s->accept_efd < 0 || s->handover_efd < 0 || s->io_cpun < 0 ||
+	    s->worker_cpun < 0 ||
+	    (cfg->rate > 0 && !s->buckets) ||
+	    (cfg->cache_bytes && (!s->cache || !s->cache_budget))) {
+		ipc_server_free(s);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// aligned for the cache line separation in struct loop
+	s->loops = aligned_alloc(_Alignof(struct loop),
+				 s->loopn * sizeof(*s->loops));
+	s->workers = calloc(s->workern + 1, sizeof(*s->workers));
+	if (s->loops) {
+		memset(s->loops, 0, s->loopn * sizeof(*s->loops));
+	}
+	if (!s->loops || !s->workers) {
+		ipc_server_free(s);
+		return NULL;
+	}
+
+	for (int i = 0; i < s->loopn; i++) {
+		struct loop *l = &s->loops[i];
+		l->srv = s;
+		l->idx = i;
+		l->epfd = epoll_create1(EPOLL_CLOEXEC);
+		l->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		atomic_init(&l->stop, false);
+		atomic_init(&l->handover, false);
+		atomic_init(&l->done, NULL);
+		atomic_init(&l->newconns, NULL);
+		atomic_init(&l->newsubs, NULL);
+		atomic_init(&l->pubs, NULL);
+		atomic_init(&l->localreqs, NULL);
+		atomic_init(&l->nconns, 0);
+		atomic_init(&l->accepted, 0);
+		atomic_init(&l->requests, 0);
+		atomic_init(&l->shed, 0);
+		atomic_init(&l->cache_hits, 0);
+		atomic_init(&l->coalesced, 0);
+		atomic_init(&l->cpu, -1);
+		atomic_init(&l->node, -1);
+		l->buf = mmap(NULL, SERVER_BUFSZ, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (l->buf == MAP_FAILED) {
+			l->buf = NULL;
+			ipc_server_free(s);
+			return NULL;
+		}
+		if (cfg->slow_ns > 0) {
+			l->slow = aligned_alloc(_Alignof(struct slow_ring),
+						sizeof(*l->slow));
+			if (!l->slow) {
+				ipc_server_free(s);
+				return NULL;
+			}
+			memset(l->slow, 0, sizeof(*l->slow));
+		}
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+		if (l->epfd < 0 || l->efd < 0 ||
+		    epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->efd, &ev)) {
+			ipc_server_free(s);
+			return NULL;
+		}
+	}
+
+	for (int i = 0; i < s->workern; i++) {
+		struct worker *w = &s->workers[i];
+		w->srv = s;
+		w->idx = i;
+		mtx_init(&w->lk, mtx_plain);
+		for (int p = 0; p < IPC_PRIORITIES; p++) {
+			struct deque *q = &w->q[p];
+			q->mask = 255;
+			q->ring = malloc((q->mask + 1) * sizeof(*q->ring));
+			if (!q->ring) {
+				ipc_server_free(s);
+				return NULL;
+			}
+		}
+	}
+
+	if (ipc_server_handle_priority(s, "stats", &stats_handler, s,
+				       IPC_PRIORITY_HIGH)) {
+		ipc_server_free(s);
+		return NULL;
+	}
+	return s;
+}
+
+void ipc_server_free(struct ipc_server *s)
+{
+	if (!s) {
+		return;
+	}
+	for (int i = 0; s->loops && i < s->loopn; i++) {
+		struct loop *l = &s->loops[i];
+		while (l->conns) {
+			struct conn *next = l->conns->next;
+			if (l->conns->local) {
+				l->conns->local->conn = NULL;
+				local_release(l->conns->local);
+			} else {
+				close(l->conns->fd);
+			}
+			free(l->conns);
+			l->conns = next;
+		}
+		struct ipc_request *r = atomic_exchange(&l->localreqs, NULL);
+		while (r) {
+			struct ipc_request *next = r->next;
+			if (r == r->local->eof) {
+				local_release(r->local);
+			} else {
+				free_request(r);
+			}
+			r = next;
+		}
+		if (l->epfd > 0) {
+			close(l->epfd);
+		}
+		if (l->efd > 0) {
+			close(l->efd);
+		}
+		if (l->buf) {
+			munmap(l->buf, SERVER_BUFSZ);
+		}
+		free(l->stats);
+		free(l->slow);
+	}
+	for (int i = 0; s->workers && i < s->workern; i++) {
+		struct worker *w = &s->workers[i];
+		if (w->srv) {
+			mtx_destroy(&w->lk);
+		}
+		for (int p = 0; p < IPC_PRIORITIES; p++) {
+			free(w->q[p].ring);
+		}
+	}
+	for (int i = 0; i < s->handlern; i++) {
+		free(s->handlers[i].verb);
+	}
+	if (s->lfd >= 0) {
+		close(s->lfd);
+	}
+	if (s->accept_efd >= 0) {
+		close(s->accept_efd);
+	}
+	if (s->handover_efd >= 0) {
+		close(s->handover_efd);
+	}
+	if (s->slow_fd >= 0 && s->cfg.slow_log) {
+		close(s->slow_fd);
+	}
+	if (s->slow_efd >= 0) {
+		close(s->slow_efd);
+	}
+	cnd_destroy(&s->handed_cv);
+	mtx_destroy(&s->handover_lk);
+	cnd_destroy(&s->idle_cv);
+	mtx_destroy(&s->idle_lk);
+	while (s->topics) {
+		struct ipc_topic *t = s->topics;
+		s->topics = t->next;
+		free(t->subs);
+		free(t->nsubs);
+		free(t);
+	}
+	for (int i = 0; s->cache && i < CACHE_SHARDS; i++) {
+		struct cache_shard *sh = &s->cache[i];
+		while (sh->n) {
+			cache_remove(sh, sh->clock[0]);
+		}
+		free(sh->clock);
+		free(sh->table);
+		mtx_destroy(&sh->lk);
+	}
+	free(s->cache);
+	for (int i = 0; s->flights && i < CACHE_SHARDS; i++) {
+		mtx_destroy(&s->flights[i].lk);
+	}
+	free(s->flights);
+	free(s->buckets);
+	free(s->io_cpus);
+	free(s->worker_cpus);
+	free(s->handlers);
+	free(s->loops);
+	free(s->workers);
+	free(s);
+}
+
+int ipc_server_handle(struct ipc_server *s, const char *verb,
+		      ipc_handler_fn fn, void *udata)
+{
+	return ipc_server_handle_priority(s, verb, fn, udata,
+					  IPC_PRIORITY_NORMAL);
+}
+
+int ipc_server_handle_priority(struct ipc_server *s, const char *verb,
+			       ipc_handler_fn fn, void *udata,
+			       enum ipc_priority prio)
+{
+	if (s->started || prio < 0 || prio >= IPC_PRIORITIES ||
+	    find_handler(s, verb, (int)strlen(verb))) {
+		return -1;
+	}
+	struct handler *h =
+		realloc(s->handlers, (s->handlern + 1) * sizeof(*h));
+	if (!h) {
+		return -1;
+	}
+	s->handlers = h;
+	h = &s->handlers[s->handlern++];
+	h->verb = strdup(verb);
+	h->verbn = (int)strlen(verb);
+	h->fn = fn;
+	h->udata = udata;
+	h->prio = prio;
+	h->cached = false;
+	h->coalesced = false;
+	atomic_init(&h->gen, 0);
+	return 0;
+}
+
+int ipc_server_cache(struct ipc_server *s, const char *verb)
+{
+	struct handler *h =
+		(struct handler *)find_handler(s, verb, (int)strlen(verb));
+	if (s->started || !h) {
+		return -1;
+	}
+	h->cached = true;
+	return 0;
+}
+
+int ipc_server_coalesce(struct ipc_server *s, const char *verb)
+{
+	struct handler *h =
+		(struct handler *)find_handler(s, verb, (int)strlen(verb));
+	if (s->started || !h) {
+		return -1;
+	}
+	if (!s->flights) {
+		s->flights = aligned_alloc(_Alignof(struct flight_shard),
+					   CACHE_SHARDS * sizeof(*s->flights));
+		if (!s->flights) {
+			return -1;
+		}
+		memset(s->flights, 0, CACHE_SHARDS * sizeof(*s->flights));
+		for (int i = 0; i < CACHE_SHARDS; i++) {
+			mtx_init(&s->flights[i].lk, mtx_plain);
+		}
+	}
+	h->coalesced = true;
+	return 0;
+}
+
+int ipc_server_invalidate(struct ipc_server *s, const char *verb)
+{
+	struct handler *h =
+		(struct handler *)find_handler(s, verb, (int)strlen(verb));
+	if (!h) {
+		return -1;
+	}
+	// entries with an older generation are never hit again and go
+	// first when their shard needs space
+	atomic_fetch_add(&h->gen, 1);
+	return 0;
+}
+
+struct ipc_topic *ipc_server_topic(struct ipc_server *s,
+				   enum ipc_topic_policy policy, int queue_max)
+{
+	if (s->started) {
+		return NULL;
+	}
+	struct ipc_topic *t = calloc(1, sizeof(*t));
+	if (!t) {
+		return NULL;
+	}
+	t->srv = s;
+	t->policy = policy;
+	unsigned n = 1;
+	while (n < (unsigned)(queue_max > 0 ? queue_max : 64)) {
+		n *= 2;
+	}
+	t->mask = n - 1;
+	t->subs = calloc(s->loopn, sizeof(*t->subs));
+	t->nsubs = calloc(s->loopn, sizeof(*t->nsubs));
+	if (!t->subs || !t->nsubs) {
+		free(t->subs);
+		free(t->nsubs);
+		free(t);
+		return NULL;
+	}
+	for (int i = 0; i < s->loopn; i++) {
+		atomic_init(&t->nsubs[i], 0);
+	}
+	atomic_init(&t->published, 0);
+	atomic_init(&t->dropped, 0);
+	t->next = s->topics;
+	s->topics = t;
+	return t;
+}
+
+void ipc_subscribe(struct ipc_request *r, struct ipc_topic *t)
+{
+	if (!r->tagged) {
+		ipc_error(r, "unsupported", "subscriptions must be tagged");
+		return;
+	} else if (r->conn->local) {
+		ipc_error(r, "unsupported", "in-process subscriptions");
+		return;
+	}
+	struct sub *sub = calloc(1, sizeof(*sub));
+	struct event **q = calloc(t->mask + 1, sizeof(*q));
+	if (!sub || !q) {
+		free(sub);
+		free(q);
+		ipc_error(r, "internal", "out of memory");
+		return;
+	}
+	sub->topic = t;
+	sub->r = r;
+	sub->q = q;
+	sub->hdrlen = sipc_format(sub->hdr, sizeof(sub->hdr), "I %llu\n",
+				  (unsigned long long)r->id);
+
+	struct loop *l = r->loop;
+	if (tls_loop == l) {
+		add_sub(l, sub);
+		return;
+	}
+	struct sub *head = atomic_load(&l->newsubs);
+	do {
+		sub->next = head;
+	} while (!atomic_compare_exchange_weak(&l->newsubs, &head, sub));
+	if (!head) {
+		wake(l->efd);
+	}
+}
+
+int ipc_vpublish(struct ipc_topic *t, const char *fmt, va_list ap)
+{
+	struct ipc_server *s = t->srv;
+	int n = sipc_vformat(tls_fmt, sizeof(tls_fmt), fmt, ap);
+	if (n < 0 || n >= (int)sizeof(tls_fmt)) {
+		return -1;
+	}
+	struct event *ev = malloc(sizeof(*ev) +
+				  s->loopn * sizeof(struct pubitem) + n);
+	if (!ev) {
+		return -1;
+	}
+	ev->items = (struct pubitem *)(ev + 1);
+	ev->buf = (char *)(ev->items + s->loopn);
+	ev->len = n;
+	memcpy(ev->buf, tls_fmt, n);
+	atomic_init(&ev->ref, 1);
+	atomic_fetch_add_explicit(&t->published, 1, memory_order_relaxed);
+
+	// the cost here is per loop, each loop then queues the event for its
+	// own subscribers
+	for (int i = 0; i < s->loopn; i++) {
+		if (!atomic_load_explicit(&t->nsubs[i], memory_order_relaxed)) {
+			continue;
+		}
+		struct loop *l = &s->loops[i];
+		struct pubitem *it = &ev->items[i];
+		it->topic = t;
+		it->ev = ev;
+		atomic_fetch_add(&ev->ref, 1);
+		if (tls_loop == l) {
+			deliver(l, it);
+			continue;
+		}
+		struct pubitem *head = atomic_load(&l->pubs);
+		do {
+			it->next = head;
+		} while (!atomic_compare_exchange_weak(&l->pubs, &head, it));
+		if (!head) {
+			wake(l->efd);
+		}
+	}
+	event_release(ev);
+	return 0;
+}
+
+int ipc_publish(struct ipc_topic *t, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = ipc_vpublish(t, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+void ipc_topic_stats(struct ipc_topic *t, struct ipc_topic_stats *st)
+{
+	st->published = atomic_load(&t->published);
+	st->dropped = atomic_load(&t->dropped);
+	st->subscribers = 0;
+	for (int i = 0; i < t->srv->loopn; i++) {
+		st->subscribers += atomic_load(&t->nsubs[i]);
+	}
+}
+
+int ipc_server_start(struct ipc_server *s, int lfd)
+{
+	if (s->cfg.handover &&
+	    ipc_server_handle_priority(s, "handover", &handover_handler, s,
+				       IPC_PRIORITY_HIGH)) {
+		return -1;
+	}
+	atomic_init(&s->handover_loops, s->loopn);
+	s->lfd = lfd;
+	s->started = true;
+	for (int i = 0; i < s->loopn; i++) {
+		// handlers are fixed from here on
+		struct loop *l = &s->loops[i];
+		l->stats = calloc(s->handlern, sizeof(*l->stats));
+		if (!l->stats) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < s->workern; i++) {
+		struct worker *w = &s->workers[i];
+		if (thrd_create(&w->thread, &worker_thread, w) != thrd_success) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < s->loopn; i++) {
+		struct loop *l = &s->loops[i];
+		if (thrd_create(&l->thread, &loop_thread, l) != thrd_success) {
+			return -1;
+		}
+	}
+	if (s->slow_fd >= 0 &&
+	    thrd_create(&s->slow_thread, &slow_thread, s) != thrd_success) {
+		return -1;
+	}
+	if (s->cfg.handover &&
+	    thrd_create(&s->handover_thread, &handover_thread, s) !=
+		    thrd_success) {
+		return -1;
+	}
+	if (thrd_create(&s->accept_thread, &accept_thread, s) !=
+	    thrd_success) {
+		return -1;
+	}
+	s->accepting = true;
+	return 0;
+}
+
+struct ipc_local *ipc_server_local(struct ipc_server *s)
+{
+	struct ipc_local *lc = calloc(1, sizeof(*lc));
+	struct newconn *nc = malloc(sizeof(*nc));
+	if (lc) {
+		lc->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		lc->eof = calloc(1, sizeof(*lc->eof));
+	}
+	if (!lc || !nc || lc->efd < 0 || !lc->eof) {
+		if (lc) {
+			if (lc->efd >= 0) {
+				close(lc->efd);
+			}
+			free(lc->eof);
+		}
+		free(lc);
+		free(nc);
+		return NULL;
+	}
+	lc->loop = pick_loop(s);
+	atomic_init(&lc->replies, NULL);
+	atomic_init(&lc->closed, false);
+	// one for the client and one for the loop's connection
+	atomic_init(&lc->ref, 2);
+	lc->eof->local = lc;
+
+	nc->fd = -1;
+	nc->local = lc;
+	push_newconn(lc->loop, nc);
+	return lc;
+}
+
+int ipc_local_fd(struct ipc_local *lc)
+{
+	return lc->efd;
+}
+
+static void local_queue(struct ipc_local *lc, struct ipc_request *r)
+{
+	struct loop *l = lc->loop;
+	struct ipc_request *head = atomic_load(&l->localreqs);
+	do {
+		r->next = head;
+	} while (!atomic_compare_exchange_weak(&l->localreqs, &head, r));
+	if (!head) {
+		wake(l->efd);
+	}
+}
+
+int ipc_local_send(struct ipc_local *lc, const char *buf, int len,
+		   const int *fds, int fdn)
+{
+	if (len > SERVER_BUFSZ || fdn > SERVER_MAX_FDS ||
+	    atomic_load(&lc->closed)) {
+		return -1;
+	}
+	// the only copy, straight into the request the handler sees
+	struct ipc_request *r = malloc(sizeof(*r) + len);
+	if (!r) {
+		return -1;
+	}
+	memset(r, 0, sizeof(*r));
+	r->local = lc;
+	r->len = len;
+	memcpy(r->buf, buf, len);
+	r->fdn = fdn;
+	memcpy(r->fds, fds, fdn * sizeof(*fds));
+	local_queue(lc, r);
+	return 0;
+}
+
+int ipc_local_recv(struct ipc_local *lc, ipc_local_fn fn, void *udata)
+{
+	// clear the wakeup before taking the replies, as for the loop's efd
+	uint64_t v;
+	read(lc->efd, &v, sizeof(v));
+	bool closed = atomic_load(&lc->closed);
+	struct ipc_request *r = atomic_exchange(&lc->replies, NULL);
+	struct ipc_request *fifo = NULL;
+	while (r) {
+		struct ipc_request *next = r->next;
+		r->next = fifo;
+		fifo = r;
+		r = next;
+	}
+	while (fifo) {
+		struct ipc_request *next = fifo->next;
+		fn(udata, fifo->reply, fifo->replylen, fifo->replyfds,
+		   fifo->replyfdn);
+		// now owned by fn
+		fifo->replyfdn = 0;
+		free_request(fifo);
+		fifo = next;
+	}
+	return closed ? -1 : 0;
+}
+
+void ipc_local_close(struct ipc_local *lc)
+{
+	if (!lc) {
+		return;
+	}
+	// the loop releases the client's reference once it sees eof
+	local_queue(lc, lc->eof);
+}
+
+int ipc_server_start_path(struct ipc_server *s, const char *path)
+{
+	int lfd = ipc_unix_listen_fds();
+	if (lfd >= 0) {
+		return ipc_server_start(s, lfd);
+	}
+	int fd = ipc_unix_connect(path);
+	if (fd >= 0) {
+		int ret = takeover(s, fd);
+		close(fd);
+		if (ret <= 0) {
+			return ret;
+		}
+	}
+	lfd = ipc_unix_listen(path);
+	if (lfd < 0) {
+		return -1;
+	}
+	return ipc_server_start(s, lfd);
+}
+
+void ipc_server_wait(struct ipc_server *s)
+{
+	mtx_lock(&s->idle_lk);
+	while (!s->handed_over) {
+		cnd_wait(&s->handed_cv, &s->idle_lk);
+	}
+	mtx_unlock(&s->idle_lk);
+}
+
+void ipc_server_stop(struct ipc_server *s)
+{
+	atomic_store(&s->stopping, true);
+	wake(s->accept_efd);
+	if (s->cfg.handover) {
+		// gives up on a handover in progress first, which may restart
+		// the accept thread
+		wake(s->handover_efd);
+		thrd_join(s->handover_thread, NULL);
+	}
+	if (s->accepting) {
+		thrd_join(s->accept_thread, NULL);
+	}
+
+	// loops stop reading and exit once their requests have been replied
+	// to, after which nothing more can be queued for the workers
+	for (int i = 0; i < s->loopn; i++) {
+		atomic_store(&s->loops[i].stop, true);
+		wake(s->loops[i].efd);
+	}
+	for (int i = 0; i < s->loopn; i++) {
+		thrd_join(s->loops[i].thread, NULL);
+	}
+	if (s->slow_fd >= 0) {
+		atomic_store(&s->slow_stop, true);
+		wake(s->slow_efd);
+		thrd_join(s->slow_thread, NULL);
+	}
+
+	mtx_lock(&s->idle_lk);
+	cnd_broadcast(&s->idle_cv);
+	mtx_unlock(&s->idle_lk);
+	for (int i = 0; i < s->workern; i++) {
+		thrd_join(s->workers[i].thread, NULL);
+	}
+}
+
+int ipc_request_fd(struct ipc_request *r, int idx)
+{
+	if (idx < 0 || idx >= r->fdn) {
+		return -1;
+	}
+	int fd = r->fds[idx];
+	r->fds[idx] = -1;
+	return fd;
+}
+
+int ipc_server_io_stats(struct ipc_server *s, struct ipc_io_stats *v, int n)
+{
+	for (int i = 0; i < n && i < s->loopn; i++) {
+		struct loop *l = &s->loops[i];
+		v[i].cpu = atomic_load(&l->cpu);
+		v[i].node = atomic_load(&l->node);
+		v[i].accepted = atomic_load(&l->accepted);
+		v[i].open = atomic_load(&l->nconns);
+		v[i].requests = atomic_load(&l->requests);
+		v[i].shed = atomic_load(&l->shed);
+		v[i].cache_hits = atomic_load(&l->cache_hits);
+		v[i].coalesced = atomic_load(&l->coalesced);
+	}
+	return s->loopn;
+}
+
+int ipc_request_node(struct ipc_request *r)
+{
+	return atomic_load_explicit(&r->loop->node, memory_order_relaxed);
+}
+
+bool ipc_request_expired(struct ipc_request *r)
+{
+	return r->deadline && monotonic_ns() >= r->deadline;
+}
+
+void *ipc_request_core(struct ipc_request *r)
+{
+	return tls_core;
+}
+
+static int format_reply(struct ipc_request *r, const int *fds, int fdn,
+			const char *fmt, va_list ap)
+{
+	int n = 0;
+	if (r->tagged) {
+		n = sipc_format(tls_fmt, sizeof(tls_fmt), "I %llu\n",
+				(unsigned long long)r->id);
+	}
+	r->replyoff = n;
+	int m = sipc_vformat(tls_fmt + n, sizeof(tls_fmt) - n, fmt, ap);
+	if (m < 0 || m >= (int)sizeof(tls_fmt) - n || fdn > SERVER_MAX_FDS) {
+		return -1;
+	}
+	n += m;
+
+	r->reply = malloc(n);
+	if (!r->reply) {
+		return 0;
+	}
+	memcpy(r->reply, tls_fmt, n);
+	r->replylen = n;
+	for (int i = 0; i < fdn; i++) {
+		// sent later from the loop thread
+		int fd = fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+		if (fd >= 0) {
+			r->replyfds[r->replyfdn++] = fd;
+		}
+	}
+	return 0;
+}
+
+static int format_replyf(struct ipc_request *r, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = format_reply(r, NULL, 0, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+// formats an error reply without completing the request
+static void error_reply(struct ipc_request *r, const char *code,
+			const char *desc)
+{
+	if (desc) {
+		format_replyf(r, "E %s %s\n", code, desc);
+	} else {
+		format_replyf(r, "E %s\n", code);
+	}
+}
+
+void ipc_error(struct ipc_request *r, const char *code, const char *desc)
+{
+	error_reply(r, code, desc);
+	complete(r);
+}
+
+int ipc_vreply_part(struct ipc_request *r, const int *fds, int fdn,
+		    const char *fmt, va_list ap)
+{
+	if (tls_loop != r->loop) {
+		// bound the memory used by parts waiting for the socket
+		long ns = 10000;
+		while (atomic_load(&r->parts) >= MAX_PARTS_QUEUED) {
+			struct timespec ts = { .tv_nsec = ns };
+			thrd_sleep(&ts, NULL);
+			ns = ns < 1000000 ? 2 * ns : ns;
+		}
+	}
+
+	struct ipc_request *t = calloc(1, sizeof(*t));
+	if (!t) {
+		return -1;
+	}
+	t->conn = r->conn;
+	t->loop = r->loop;
+	t->seq = r->seq;
+	t->id = r->id;
+	t->tagged = r->tagged;
+	t->parent = r;
+	t->part = true;
+	if (format_reply(t, fds, fdn, fmt, ap)) {
+		free(t);
+		return -1;
+	}
+	t->part_counted = true;
+	// streamed results aren't cached
+	r->cacheable = false;
+	atomic_fetch_add(&r->parts, 1);
+	complete(t);
+	return 0;
+}
+
+int ipc_reply_part(struct ipc_request *r, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = ipc_vreply_part(r, NULL, 0, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+int ipc_vreply(struct ipc_request *r, const int *fds, int fdn,
+	       const char *fmt, va_list ap)
+{
+	if (format_reply(r, fds, fdn, fmt, ap)) {
+		ipc_error(r, "internal", "reply too large");
+		return -1;
+	}
+	if (r->cacheable && r->reply) {
+		cache_put(r->loop->srv, r);
+	}
+	complete(r);
+	return 0;
+}
+
+int ipc_reply(struct ipc_request *r, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = ipc_vreply(r, NULL, 0, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+#endif
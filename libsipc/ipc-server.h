@@ -0,0 +1,347 @@
+#pragma once
+#include "ipc.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Server runtime. Connections accepted from a listening socket are spread
+// over a number of I/O threads, each running its own epoll loop. I/O threads
+// receive and parse requests and push them to a fixed pool of worker
+// threads. Each worker has its own deque and steals from the others when it
+// runs dry. Replies are handed back to the I/O thread owning the connection
+// through a lock-free MPSC queue and are sent in request order, except for
+// tagged requests (see sipc_request_id) which are sent as soon as they
+// complete. Requests whose deadline (see sipc_deadline) passes before a
+// worker picks them up are replied to with E timeout by the I/O thread and
+// never reach the handler.
+//
+// In thread-per-core mode there are no workers. Each I/O thread runs the
+// handlers for its own connections inline and all per-connection state stays
+// on that thread.
+struct ipc_server;
+struct ipc_request;
+
+// Called on a worker thread for each request. args is setup to parse the
+// request arguments following the verb. The handler must complete the
+// request with ipc_reply or ipc_error, either before returning or later
+// from any thread.
+typedef void (*ipc_handler_fn)(void *udata, struct ipc_request *r,
+			       sipc_parser_t *args);
+
+// Priority classes for verbs. Each class has its own queues.
+enum ipc_priority {
+	// health checks and control verbs
+	IPC_PRIORITY_HIGH,
+	IPC_PRIORITY_NORMAL,
+	// bulk transfers and other long running work
+	IPC_PRIORITY_BULK,
+	IPC_PRIORITIES,
+};
+
+enum ipc_sched {
+	// always run the highest priority request available
+	IPC_SCHED_STRICT,
+	// run up to weights[p] requests from each class in turn
+	IPC_SCHED_WEIGHTED,
+};
+
+enum ipc_balance {
+	// hand accepted connections to each I/O thread in turn
+	IPC_ROUND_ROBIN,
+	// hand accepted connections to the I/O thread with the fewest
+	IPC_LEAST_LOADED,
+};
+
+struct ipc_server_config {
+	// number of I/O threads, defaults to 1 or the number of CPUs in
+	// thread-per-core mode
+	int io_threads;
+	// number of worker threads, defaults to the number of CPUs
+	int workers;
+	// run handlers on the I/O threads instead of a worker pool
+	bool per_core;
+	enum ipc_balance balance;
+	// Optional per thread handler state, created on each thread that runs
+	// handlers (the I/O threads in thread-per-core mode, otherwise the
+	// workers) before it starts. core is the index of the thread. See
+	// ipc_request_core.
+	void *(*core_init)(void *udata, int core);
+	void (*core_free)(void *udata, void *state);
+	void *core_udata;
+	// I/O threads busy poll for up to this long before blocking in
+	// epoll_wait (see ipc_unix_recvmsg_spin), zero disables spinning
+	long spin_ns;
+	// pin I/O threads and then workers to consecutive CPUs starting at
+	// first_cpu
+	bool pin;
+	int first_cpu;
+	// Alternatively pin I/O threads and workers to CPU sets given as Linux
+	// CPU lists (e.g. "0-7,16-23"). Thread i runs on the i'th CPU in the
+	// list, wrapping around. Each I/O thread's receive buffer is placed on
+	// the NUMA node it runs on.
+	const char *io_cpus;
+	const char *worker_cpus;
+	// Admission control. Requests over a limit are rejected with
+	// E overloaded without running the handler. Zero disables a limit.
+	// requests each connection may have running or queued for a handler,
+	// not counting those answered from the cache or by a coalesced run
+	int max_inflight;
+	// requests queued for the workers across the server
+	int max_queued;
+	// token bucket rate limit shared by all connections from the same
+	// client, in requests per second with a burst of up to burst requests
+	// (defaults to one second's worth)
+	double rate;
+	int burst;
+	// identify clients by pid instead of uid (see SO_PEERCRED)
+	bool rate_by_pid;
+	// How requests are picked between priority classes. Weights default
+	// to 16, 4 and 1.
+	enum ipc_sched sched;
+	int weights[IPC_PRIORITIES];
+	// Memory budget for the response cache in bytes, zero disables it.
+	// See ipc_server_cache.
+	size_t cache_bytes;
+	// Hand over to a successor started by the same user with
+	// ipc_server_start_path. The server passes on its listening socket,
+	// stops accepting and then passes on each connection once it has no
+	// requests outstanding, so that restarts don't drop or refuse any
+	// connections. Subscriptions are ended with an S reply. If the
+	// successor goes away midway the server resumes accepting and keeps
+	// the connections it hasn't passed on yet.
+	bool handover;
+	// Slow request log. Requests taking longer than slow_ns from being
+	// read to their final reply being sent are appended to slow_log
+	// (stderr if NULL), one line each with the verb, sizes, fd counts and
+	// the time spent in each phase (see the stats verb). I/O threads queue
+	// them on lock-free rings, dropping them when full, and a low priority
+	// thread writes them out. Zero disables the log.
+	long slow_ns;
+	const char *slow_log;
+};
+
+struct ipc_io_stats {
+	// CPU and NUMA node the I/O thread started on, -1 if not yet known
+	int cpu;
+	int node;
+	// connections handed to the thread and those still open
+	unsigned long accepted;
+	int open;
+	unsigned long requests;
+	// requests rejected by admission control
+	unsigned long shed;
+	// requests replied to from the response cache
+	unsigned long cache_hits;
+	// requests that waited on an identical one (see ipc_server_coalesce)
+	unsigned long coalesced;
+};
+
+// Publish/subscribe. Each event is formatted once into a shared buffer and
+// queued for every subscriber. Subscribers that fall behind have a bounded
+// queue, which either drops new events or coalesces them.
+struct ipc_topic;
+
+enum ipc_topic_policy {
+	// a full queue drops new events
+	IPC_TOPIC_DROP,
+	// a full queue replaces its newest event with the new one, so a slow
+	// subscriber skips intermediate events but always sees the latest
+	IPC_TOPIC_COALESCE,
+};
+
+struct ipc_topic_stats {
+	unsigned long published;
+	// events dropped or coalesced across all subscribers
+	unsigned long dropped;
+	int subscribers;
+};
+
+// returns NULL on error
+struct ipc_server *ipc_server_new(const struct ipc_server_config *cfg);
+// The server must be stopped first
+void ipc_server_free(struct ipc_server *s);
+
+// Registers the handler for a verb. Must be called before ipc_server_start.
+// Each verb can only be registered once. The stats verb is reserved: it
+// replies with a map from verb to its request and error counts and latency
+// histograms of the time spent parsing, queued, in the handler and sending
+// the reply. It takes an optional verb to limit the reply to.
+// Handlers registered with ipc_server_handle have normal priority.
+// Priorities reorder requests that are waiting to run, including pipelined
+// requests from the same connection, but untagged replies are still sent in
+// request order.
+// returns zero on success, non-zero on error
+int ipc_server_handle(struct ipc_server *s, const char *verb,
+		      ipc_handler_fn fn, void *udata);
+int ipc_server_handle_priority(struct ipc_server *s, const char *verb,
+			       ipc_handler_fn fn, void *udata,
+			       enum ipc_priority prio);
+
+// Marks a registered verb as idempotent so that its successful replies are
+// cached, keyed on the request bytes following any request ID and deadline.
+// A repeated request is replied to by the I/O thread without being parsed or
+// reaching the handler, and without admission control. Requests and replies
+// carrying file descriptors and streamed replies are never cached. Must be
+// called before ipc_server_start.
+// returns zero on success, non-zero on error
+int ipc_server_cache(struct ipc_server *s, const char *verb);
+
+// Marks a registered verb as coalescible. A request that arrives while an
+// identical one (compared as for ipc_server_cache) is queued or running
+// waits for it instead of running the handler again, and gets a copy of its
+// reply, including errors and file descriptors. Timeouts are not shared: if
+// the request waited on times out before running, one of those waiting whose
+// own deadline hasn't passed runs in its place. Requests carrying file
+// descriptors are not coalesced, nor should streaming verbs be. Must be
+// called before ipc_server_start.
+// returns zero on success, non-zero on error
+int ipc_server_coalesce(struct ipc_server *s, const char *verb);
+
+// Drops the cached replies for a verb, e.g. after the state it reads has
+// changed. Can be called from any thread. Replies to requests read before
+// the call are not cached.
+// returns zero on success, non-zero if the verb is not registered
+int ipc_server_invalidate(struct ipc_server *s, const char *verb);
+
+// Starts the I/O and worker threads and accepts connections from the
+// listening socket lfd (see ipc_unix_listen). The server takes ownership of
+// lfd.
+// returns zero on success, non-zero on error
+int ipc_server_start(struct ipc_server *s, int lfd);
+
+// Starts the server listening on path. Uses a socket passed in by a service
+// manager if there is one (see ipc_unix_listen_fds), otherwise takes over
+// the listening socket and connections of a server already running on path
+// with handover enabled. Falls back to ipc_unix_listen.
+// returns zero on success, non-zero on error
+int ipc_server_start_path(struct ipc_server *s, const char *path);
+
+// Blocks until the server has handed everything over to a successor, after
+// which it should be stopped.
+void ipc_server_wait(struct ipc_server *s);
+
+// Creates a topic. Must be called before ipc_server_start. queue_max bounds
+// the events queued for each subscriber, defaults to 64. The topic is freed
+// with the server.
+// returns NULL on error
+struct ipc_topic *ipc_server_topic(struct ipc_server *s,
+				   enum ipc_topic_policy policy, int queue_max);
+
+// Subscribes the request's connection to the topic. Call this from the
+// handler instead of completing the request. Each event is sent as a
+// partial reply (see ipc_reply_part) with the request's ID, and the
+// subscription ends with an S reply when the connection closes. Requests
+// must be tagged, untagged requests are completed with an error.
+void ipc_subscribe(struct ipc_request *r, struct ipc_topic *t);
+
+// Publishes an event to all current subscribers. The format should contain
+// a single P submessage. Can be called from any thread.
+// returns zero on success, non-zero if the event could not be formatted
+int ipc_publish(struct ipc_topic *t, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+int ipc_vpublish(struct ipc_topic *t, const char *fmt, va_list ap)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 0)))
+#endif
+	;
+
+void ipc_topic_stats(struct ipc_topic *t, struct ipc_topic_stats *st);
+
+// In-process connections, for clients in the same process as the server.
+// Messages use the same format as on a socket but are passed through
+// lock-free queues. See also ipc_client_local.
+struct ipc_local;
+
+// Called with each reply, which is only valid for the duration of the call.
+// The callee takes ownership of any file descriptors.
+typedef void (*ipc_local_fn)(void *udata, const char *buf, int len,
+			     const int *fds, int fdn);
+
+// Opens an in-process connection. Subscriptions and handover are not
+// supported. The connection must be closed before the server is freed.
+// returns NULL on error
+struct ipc_local *ipc_server_local(struct ipc_server *s);
+// returns an eventfd that is readable when ipc_local_recv has work to do
+int ipc_local_fd(struct ipc_local *lc);
+// Queues a request. Takes ownership of fds on success. Can be called from
+// any thread.
+// returns zero on success, non-zero on error
+int ipc_local_send(struct ipc_local *lc, const char *buf, int len,
+		   const int *fds, int fdn);
+// Passes the replies received so far to fn, oldest first. Must only be
+// called from one thread at a time.
+// returns zero, or -ve once the server has closed the connection
+int ipc_local_recv(struct ipc_local *lc, ipc_local_fn fn, void *udata);
+// Requests already sent still run but their replies are dropped
+void ipc_local_close(struct ipc_local *lc);
+
+// Fills in up to n entries, one per I/O thread.
+// returns the number of I/O threads
+int ipc_server_io_stats(struct ipc_server *s, struct ipc_io_stats *v, int n);
+
+// Stops accepting connections, finishes any queued requests and joins all
+// threads. Requests held by a handler must have been completed first.
+void ipc_server_stop(struct ipc_server *s);
+
+// Returns the idx'th file descriptor received with the request, or -ve if
+// there isn't one. The caller takes ownership. Any file descriptors not taken
+// are closed when the request completes.
+int ipc_request_fd(struct ipc_request *r, int idx);
+
+// Returns true if the request carried a deadline that has now passed. Long
+// running handlers should check this and give up with
+// ipc_error(r, "timeout", ...).
+bool ipc_request_expired(struct ipc_request *r);
+
+// Returns the NUMA node of the I/O thread that owns the request's
+// connection, or -1 if unknown.
+int ipc_request_node(struct ipc_request *r);
+
+// Returns the state created by core_init for the thread running the handler.
+// As no other thread touches it, it can be used without locks. Only valid
+// within the handler call.
+void *ipc_request_core(struct ipc_request *r);
+
+// Completes the request. The format (see sipc_format) should contain the
+// full reply message, typically a single S submessage (e.g. "S %d\n"). The
+// request ID is added for tagged requests. fds are sent with the reply and
+// are not closed. The request must not be used afterwards.
+// returns zero on success, non-zero if the reply could not be formatted, in
+// which case the request is completed with an error instead
+int ipc_reply(struct ipc_request *r, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+int ipc_vreply(struct ipc_request *r, const int *fds, int fdn,
+	       const char *fmt, va_list ap)
+#ifdef __GNUC__
+	__attribute__((format(printf, 4, 0)))
+#endif
+	;
+
+// Sends a partial result ahead of the final reply, for verbs whose result is
+// too large to build in one message. The format should contain a single P
+// submessage (e.g. "P %*p\n"). The request must still be completed with
+// ipc_reply or ipc_error afterwards. Workers block once too many parts are
+// waiting for the socket. Parts of untagged requests that are waiting for
+// replies to earlier requests, or that are sent from an I/O thread in
+// thread-per-core mode, are not limited.
+// returns zero on success, non-zero if the part could not be formatted
+int ipc_reply_part(struct ipc_request *r, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+int ipc_vreply_part(struct ipc_request *r, const int *fds, int fdn,
+		    const char *fmt, va_list ap)
+#ifdef __GNUC__
+	__attribute__((format(printf, 4, 0)))
+#endif
+	;
+
+// Completes the request with an E submessage (E <code> <desc>)
+void ipc_error(struct ipc_request *r, const char *code, const char *desc);
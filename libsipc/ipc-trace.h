@@ -0,0 +1,25 @@
+#pragma once
+
+// USDT probes on the message hot paths, for bpftrace, perf and friends (see
+// trace/ for scripts). Building with -DSIPC_USDT (make USDT=1) needs
+// <sys/sdt.h> from systemtap's sdt development package. Each probe is then a
+// nop plus an ELF note and its arguments are only evaluated into registers.
+// Otherwise probes compile to nothing.
+//
+// Probes, provider sipc:
+//   recv(fd, size, fdn)          message read by ipc_unix_recvmsg
+//   send(fd, size, fdn)          message sent by ipc_unix_sendmsg
+//   unframe(buf, size)           complete message found by sipc_unframe
+//   parse_start(req, size, fdn)  server starts parsing a request
+//   parse_end(req, verb, verbn)  request parsed
+//   dispatch(req, verb, verbn)   handler invoked
+//   complete(req)                handler completed the request
+//   reply(req, size, fdn, part)  reply sent, part is set for partial results
+// req is the server's request pointer, which ties the server probes together
+// for the lifetime of a request. verb is not NUL terminated.
+#ifdef SIPC_USDT
+#include <sys/sdt.h>
+#define SIPC_PROBE(...) STAP_PROBEV(sipc, __VA_ARGS__)
+#else
+#define SIPC_PROBE(...) ((void)0)
+#endif
@@ -1,12 +1,26 @@
 #ifndef _WIN32
+#define _GNU_SOURCE
 #include "ipc-unix.h"
+#include "ipc.h"
+#include "ipc-trace.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/inotify.h>
+#endif
 #include <sys/un.h>
 #include <sys/socket.h>
 
 #define SCM_MAX_FDS 255
+#define DGRAM_BATCH 64
 
 struct sockaddr *ipc_new_unix_addr(const char *path, int *psasz)
 {
@@ -39,6 +53,102 @@ int ipc_unix_connect(const char *path)
 	return fd;
 }
 
+static long long monotonic_ns(void);
+
+// waits up to ns (forever if -ve) for fd to become readable
+static void wait_fd(int fd, long long ns)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+#ifdef __linux__
+	struct timespec ts = { .tv_sec = ns / 1000000000,
+			       .tv_nsec = ns % 1000000000 };
+	ppoll(&pfd, fd >= 0, ns < 0 ? NULL : &ts, NULL);
+#else
+	poll(&pfd, fd >= 0, ns < 0 ? -1 : (int)((ns + 999999) / 1000000));
+#endif
+}
+
+int ipc_unix_connect_wait(const char *path, int timeout_ms)
+{
+	long long deadline = timeout_ms < 0 ?
+				     -1 :
+				     monotonic_ns() + timeout_ms * 1000000LL;
+	int ifd = -1;
+	const char *name = strrchr(path, '/');
+#ifdef __linux__
+	// Watch the directory for the socket being created, either directly
+	// by bind or by renaming a temporary socket over it. The watch is
+	// added before the first attempt so that nothing is missed.
+	char *dir = name ? strndup(path, name == path ? 1 : name - path) :
+			   strdup(".");
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd >= 0 && (!dir || inotify_add_watch(ifd, dir,
+						   IN_CREATE | IN_MOVED_TO |
+							   IN_ATTRIB) < 0)) {
+		// e.g. the directory doesn't exist yet, fall back to retrying
+		close(ifd);
+		ifd = -1;
+	}
+	free(dir);
+#endif
+	name = name ? name + 1 : path;
+
+	// Without a watch, or when the socket exists but isn't listening yet
+	// (between bind and listen, or left behind by a server that died),
+	// retry with backoff instead.
+	long long backoff = 0;
+	for (;;) {
+		int fd = ipc_unix_connect(path);
+		if (fd >= 0 || (errno != ENOENT && errno != ECONNREFUSED)) {
+			int err = errno;
+			if (ifd >= 0) {
+				close(ifd);
+			}
+			errno = err;
+			return fd;
+		}
+		long long wait = -1;
+		if (errno == ECONNREFUSED || ifd < 0) {
+			backoff = backoff ? 2 * backoff : 100000;
+			backoff = backoff < 100000000 ? backoff : 100000000;
+			wait = backoff;
+		}
+		if (deadline >= 0) {
+			long long left = deadline - monotonic_ns();
+			if (left <= 0) {
+				if (ifd >= 0) {
+					close(ifd);
+				}
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			wait = wait < 0 || left < wait ? left : wait;
+		}
+		wait_fd(ifd, wait);
+
+#ifdef __linux__
+		// drain the events, only retrying early for the socket's name
+		char buf[4096]
+			__attribute__((aligned(__alignof__(struct inotify_event))));
+		bool match = ifd < 0;
+		ssize_t n;
+		while (ifd >= 0 && (n = read(ifd, buf, sizeof(buf))) > 0) {
+			for (char *p = buf; p < buf + n;) {
+				struct inotify_event *ev = (void *)p;
+				if ((ev->mask & IN_Q_OVERFLOW) ||
+				    (ev->len && !strcmp(ev->name, name))) {
+					match = true;
+				}
+				p += sizeof(*ev) + ev->len;
+			}
+		}
+		if (match) {
+			backoff = 0;
+		}
+#endif
+	}
+}
+
 int ipc_unix_listen(const char *path)
 {
 	int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
@@ -60,6 +170,23 @@ int ipc_unix_listen(const char *path)
 	return fd;
 }
 
+int ipc_unix_listen_fds(void)
+{
+	// see sd_listen_fds(3), the first passed fd is always 3
+	const char *pid = getenv("LISTEN_PID");
+	const char *n = getenv("LISTEN_FDS");
+	if (!pid || !n || atol(pid) != (long)getpid() || atoi(n) < 1) {
+		return -1;
+	}
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	if (fcntl(3, F_SETFD, FD_CLOEXEC)) {
+		return -1;
+	}
+	return 3;
+}
+
 int ipc_unix_sendmsg(int fd, const char *buf, int sz, const int *fds, int fdn)
 {
 	union {
@@ -87,10 +214,17 @@ int ipc_unix_sendmsg(int fd, const char *buf, int sz, const int *fds, int fdn)
 		memcpy(CMSG_DATA(cmsg), fds, fdn * sizeof(*fds));
 	}
 
+	SIPC_PROBE(send, fd, sz, fdn);
+#ifdef MSG_NOSIGNAL
+	// report a closed peer as EPIPE rather than raising SIGPIPE
+	return (int)sendmsg(fd, &msg, MSG_NOSIGNAL);
+#else
 	return (int)sendmsg(fd, &msg, 0);
+#endif
 }
 
-int ipc_unix_recvmsg(int fd, char *buf, int sz, int *fds, int *fdn)
+static int recvmsg_flags(int fd, char *buf, int sz, int *fds, int *fdn,
+			 int flags)
 {
 	union {
 		struct cmsghdr hdr;
@@ -110,7 +244,7 @@ int ipc_unix_recvmsg(int fd, char *buf, int sz, int *fds, int *fdn)
 		msg.msg_control = control.buf;
 	}
 
-	int r = recvmsg(fd, &msg, 0);
+	int r = recvmsg(fd, &msg, flags);
 	if (r >= 0 && fdn && *fdn) {
 		int n = 0;
 		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
@@ -118,13 +252,14 @@ int ipc_unix_recvmsg(int fd, char *buf, int sz, int *fds, int *fdn)
 			if (cmsg->cmsg_level == SOL_SOCKET &&
 			    cmsg->cmsg_type == SCM_RIGHTS) {
 				unsigned char *p = CMSG_DATA(cmsg);
-				unsigned char *e = p + cmsg->cmsg_len;
-				for (; p + sizeof(int) < e; p += sizeof(int)) {
+				unsigned char *e =
+					(unsigned char *)cmsg + cmsg->cmsg_len;
+				for (; p + sizeof(int) <= e; p += sizeof(int)) {
 					int fd;
 					memcpy(&fd, p, sizeof(fd));
-					if (fd > 0 && n < *fdn) {
+					if (n < *fdn) {
 						fds[n++] = fd;
-					} else if (fd > 0) {
+					} else {
 						close(fd);
 					}
 				}
@@ -132,7 +267,504 @@ int ipc_unix_recvmsg(int fd, char *buf, int sz, int *fds, int *fdn)
 		}
 		*fdn = n;
 	}
+	if (r >= 0) {
+		SIPC_PROBE(recv, fd, r, fdn ? *fdn : 0);
+	}
+	return r;
+}
+
+int ipc_stream_pipe_size(int pipe, int size)
+{
+#ifdef F_SETPIPE_SZ
+	return fcntl(pipe, F_SETPIPE_SZ, size);
+#else
+	(void)pipe;
+	(void)size;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int ipc_stream_send(int fd, const char *buf, int sz, bool local_write)
+{
+	int fds[2];
+	if (pipe(fds)) {
+		return -1;
+	}
+	// not fatal - the pipe is just slower
+	ipc_stream_pipe_size(fds[1], IPC_STREAM_PIPE_SIZE);
+
+	int local = local_write ? fds[1] : fds[0];
+	int remote = local_write ? fds[0] : fds[1];
+	int err = ipc_unix_sendmsg(fd, buf, sz, &remote, 1) != sz;
+	close(remote);
+	if (err) {
+		close(local);
+		return -1;
+	}
+	return local;
+}
+
+static long long copy_fallback(int in, int out, long long n)
+{
+	char buf[64 * 1024];
+	long long total = 0;
+	while (n < 0 || total < n) {
+		size_t want = sizeof(buf);
+		if (n >= 0 && (long long)want > n - total) {
+			want = (size_t)(n - total);
+		}
+		ssize_t r = read(in, buf, want);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0) {
+			return -1;
+		} else if (r == 0) {
+			break;
+		}
+		for (ssize_t off = 0; off < r;) {
+			ssize_t w = write(out, buf + off, r - off);
+			if (w < 0 && errno == EINTR) {
+				continue;
+			} else if (w < 0) {
+				return -1;
+			}
+			off += w;
+		}
+		total += r;
+	}
+	return total;
+}
+
+long long ipc_stream_copy(int in, int out, long long n)
+{
+	long long total = 0;
+#ifdef SPLICE_F_MOVE
+	while (n < 0 || total < n) {
+		size_t want = IPC_STREAM_PIPE_SIZE;
+		if (n >= 0 && (long long)want > n - total) {
+			want = (size_t)(n - total);
+		}
+		ssize_t r = splice(in, NULL, out, NULL, want,
+				   SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0 && total == 0 &&
+			   (errno == EINVAL || errno == ENOSYS)) {
+			// neither side is a pipe or the fd type isn't supported
+			break;
+		} else if (r < 0) {
+			return -1;
+		} else if (r == 0) {
+			return total;
+		}
+		total += r;
+	}
+	if (total) {
+		return total;
+	}
+#endif
+	return copy_fallback(in, out, n);
+}
+
+long long ipc_stream_write(int pipe, const void *buf, long long n)
+{
+	const char *p = buf;
+	long long total = 0;
+	while (total < n) {
+#ifdef SPLICE_F_MOVE
+		struct iovec iov = {
+			.iov_base = (char *)p + total,
+			.iov_len = (size_t)(n - total),
+		};
+		ssize_t r = vmsplice(pipe, &iov, 1, 0);
+#else
+		ssize_t r = write(pipe, p + total, (size_t)(n - total));
+#endif
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0) {
+			return -1;
+		}
+		total += r;
+	}
+	return total;
+}
+
+long long ipc_stream_tee(int in, int out, long long n)
+{
+#ifdef SPLICE_F_MOVE
+	for (;;) {
+		ssize_t r = tee(in, out, (size_t)n, 0);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		return r;
+	}
+#else
+	(void)in;
+	(void)out;
+	(void)n;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int ipc_unix_recvmsg(int fd, char *buf, int sz, int *fds, int *fdn)
+{
+	return recvmsg_flags(fd, buf, sz, fds, fdn, 0);
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static long long monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int ipc_unix_recvmsg_spin(int fd, char *buf, int sz, int *fds, int *fdn,
+			  struct ipc_spin *s)
+{
+	int fdcap = fdn ? *fdn : 0;
+	if (s->budget_ns <= 0) {
+		return recvmsg_flags(fd, buf, sz, fds, fdn, 0);
+	}
+
+	long long start = monotonic_ns();
+	long long now = start;
+	for (unsigned i = 0;; i++) {
+		if (fdn) {
+			*fdn = fdcap;
+		}
+		int r = recvmsg_flags(fd, buf, sz, fds, fdn, MSG_DONTWAIT);
+		if (r >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			// check the clock again so that the spin time is
+			// accurate for the hit
+			s->spin_ns += monotonic_ns() - start;
+			s->hits += (r >= 0);
+			return r;
+		}
+		// reading the clock costs about as much as the syscall, so
+		// only check it every few iterations
+		if ((i & 7) == 7) {
+			now = monotonic_ns();
+			if (now - start >= s->budget_ns) {
+				break;
+			}
+		}
+		cpu_relax();
+	}
+
+	s->spin_ns += now - start;
+	s->misses++;
+	if (fdn) {
+		*fdn = fdcap;
+	}
+	return recvmsg_flags(fd, buf, sz, fds, fdn, 0);
+}
+
+int ipc_pin_cpu(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+#else
+	(void)cpu;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int udp_socket(const char *host, const char *port, bool do_bind)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM,
+		.ai_flags = do_bind ? AI_PASSIVE : 0,
+	};
+	struct addrinfo *res;
+	if (getaddrinfo(host, port, &hints, &res)) {
+		return -1;
+	}
+
+	int fd = -1;
+	for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		int err = do_bind ? bind(fd, ai->ai_addr, ai->ai_addrlen) :
+				    connect(fd, ai->ai_addr, ai->ai_addrlen);
+		if (!err) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+int ipc_udp_bind(const char *host, const char *port)
+{
+	return udp_socket(host, port, true);
+}
+
+int ipc_udp_connect(const char *host, const char *port)
+{
+	return udp_socket(host, port, false);
+}
+
+void ipc_dgram_init(struct ipc_dgram_packer *w, int fd, char *buf, int cap)
+{
+	w->fd = fd;
+	w->len = 0;
+	w->cap = cap;
+	w->buf = buf;
+	w->sent = 0;
+}
+
+int ipc_dgram_flush(struct ipc_dgram_packer *w)
+{
+	if (!w->len) {
+		return 0;
+	}
+	int sz = w->len;
+	w->len = 0;
+	if (send(w->fd, w->buf, sz, 0) != sz) {
+		return -1;
+	}
+	w->sent++;
+	return 0;
+}
+
+int ipc_dgram_append(struct ipc_dgram_packer *w, const char *msg, int sz)
+{
+	if (sz > w->cap) {
+		return -1;
+	} else if (w->len + sz > w->cap && ipc_dgram_flush(w)) {
+		return -1;
+	}
+	memcpy(w->buf + w->len, msg, sz);
+	w->len += sz;
+	return 0;
+}
+
+int ipc_dgram_vformat(struct ipc_dgram_packer *w, const char *fmt, va_list ap)
+{
+	for (;;) {
+		char *p = w->buf + w->len;
+		// the frame header limits a message to 16 bits
+		int avail = w->cap - w->len;
+		if (avail > 0xFFFF) {
+			avail = 0xFFFF;
+		}
+
+		if (avail > 5) {
+			va_list aq;
+			va_copy(aq, ap);
+			int n = sipc_vformat(p + 5, avail - 5, fmt, aq);
+			va_end(aq);
+			if (n < 0) {
+				return -1;
+			} else if (n < avail - 5) {
+				if (!n || p[5 + n - 1] != '\n') {
+					return -1;
+				}
+				p[4] = '\n';
+				sipc_frame(p, 5 + n);
+				w->len += 5 + n;
+				return 0;
+			}
+		}
+
+		// doesn't fit in the remainder of this datagram
+		if (!w->len) {
+			return -1;
+		} else if (ipc_dgram_flush(w)) {
+			return -1;
+		}
+	}
+}
+
+int ipc_dgram_format(struct ipc_dgram_packer *w, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = ipc_dgram_vformat(w, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+static void dgram_control(struct msghdr *msg, struct ipc_dgram *d)
+{
+	d->pid = d->uid = d->gid = -1;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET) {
+			continue;
+		}
+#ifdef SCM_CREDENTIALS
+		if (cmsg->cmsg_type == SCM_CREDENTIALS) {
+			struct ucred cred;
+			memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+			d->pid = (int)cred.pid;
+			d->uid = (int)cred.uid;
+			d->gid = (int)cred.gid;
+		}
+#endif
+		if (cmsg->cmsg_type == SCM_RIGHTS) {
+			// notifications don't carry file descriptors
+			unsigned char *p = CMSG_DATA(cmsg);
+			unsigned char *e = (unsigned char *)cmsg + cmsg->cmsg_len;
+			for (; p + sizeof(int) <= e; p += sizeof(int)) {
+				int fd;
+				memcpy(&fd, p, sizeof(fd));
+				close(fd);
+			}
+		}
+	}
+}
+
+#ifdef SCM_CREDENTIALS
+#define DGRAM_CONTROL_SIZE CMSG_SPACE(sizeof(struct ucred))
+#else
+#define DGRAM_CONTROL_SIZE CMSG_SPACE(sizeof(int))
+#endif
+
+int ipc_dgram_recv(int fd, struct ipc_dgram *v, int n)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[DGRAM_CONTROL_SIZE];
+	} control[DGRAM_BATCH];
+#ifdef __linux__
+	struct mmsghdr msgs[DGRAM_BATCH];
+	struct iovec iov[DGRAM_BATCH];
+	if (n > DGRAM_BATCH) {
+		n = DGRAM_BATCH;
+	}
+	for (int i = 0; i < n; i++) {
+		iov[i].iov_base = v[i].buf;
+		iov[i].iov_len = v[i].cap;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = control[i].buf;
+		msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+	}
+
+	int r = recvmmsg(fd, msgs, n, MSG_WAITFORONE, NULL);
+	for (int i = 0; i < r; i++) {
+		v[i].len = (int)msgs[i].msg_len;
+		dgram_control(&msgs[i].msg_hdr, &v[i]);
+	}
 	return r;
+#else
+	int i = 0;
+	if (n > DGRAM_BATCH) {
+		n = DGRAM_BATCH;
+	}
+	while (i < n) {
+		struct iovec iov = {
+			.iov_base = v[i].buf,
+			.iov_len = v[i].cap,
+		};
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control[i].buf,
+			.msg_controllen = sizeof(control[i]),
+		};
+		int r = (int)recvmsg(fd, &msg, i ? MSG_DONTWAIT : 0);
+		if (r < 0) {
+			return i ? i : -1;
+		}
+		v[i].len = r;
+		dgram_control(&msg, &v[i]);
+		i++;
+	}
+	return i;
+#endif
+}
+
+int ipc_unix_dgram_listen(const char *path, bool creds)
+{
+	int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	unlink(path);
+
+	int sasz;
+	struct sockaddr *sa = ipc_new_unix_addr(path, &sasz);
+	int err = bind(fd, sa, sasz);
+	free(sa);
+	if (err) {
+		close(fd);
+		return -1;
+	}
+
+#ifdef SO_PASSCRED
+	int one = 1;
+	if (creds && setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one))) {
+		close(fd);
+		return -1;
+	}
+#else
+	if (creds) {
+		close(fd);
+		return -1;
+	}
+#endif
+
+	return fd;
+}
+
+int ipc_unix_dgram_socket(void)
+{
+	return socket(AF_UNIX, SOCK_DGRAM, 0);
+}
+
+int ipc_unix_dgram_connect(const char *path)
+{
+	int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	int sasz;
+	struct sockaddr *sa = ipc_new_unix_addr(path, &sasz);
+	int err = connect(fd, sa, sasz);
+	free(sa);
+	if (err) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int ipc_unix_sendto(int fd, const char *path, const char *buf, int sz)
+{
+	int sasz;
+	struct sockaddr *sa = ipc_new_unix_addr(path, &sasz);
+	int r = (int)sendto(fd, buf, sz, 0, sa, sasz);
+	free(sa);
+	return r != sz;
 }
 
 #endif
\ No newline at end of file
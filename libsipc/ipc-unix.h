@@ -1,4 +1,6 @@
 #pragma once
+#include <stdarg.h>
+#include <stdbool.h>
 
 struct sockaddr;
 struct sockaddr *ipc_new_unix_addr(const char *path, int *psasz);
@@ -7,6 +9,18 @@ struct sockaddr *ipc_new_unix_addr(const char *path, int *psasz);
 int ipc_unix_connect(const char *path);
 int ipc_unix_listen(const char *path);
 
+// Connects to path, waiting up to timeout_ms (forever if -ve) for a server
+// to start listening on it. On Linux the directory is watched with inotify,
+// so the connection is made as soon as the socket is created or renamed
+// into place. Sets errno to ETIMEDOUT on timeout.
+// returns file descriptor or -ve on error
+int ipc_unix_connect_wait(const char *path, int timeout_ms);
+
+// Returns the first listening socket passed in by a service manager using
+// the LISTEN_FDS protocol (e.g. systemd socket activation) and clears the
+// environment variables, or -ve if there is none.
+int ipc_unix_listen_fds(void);
+
 // returns zero on success, non-zero on error
 int ipc_unix_sendmsg(int fd, const char *buf, int sz, const int *fds, int fdn);
 
@@ -15,3 +29,135 @@ int ipc_unix_sendmsg(int fd, const char *buf, int sz, const int *fds, int fdn);
 // -ve on error - check errno
 // fdn is an inout value
 int ipc_unix_recvmsg(int fd, char *buf, int sz, int *fds, int *fdn);
+
+// Connectionless unix datagram endpoint for one way notifications. Any number
+// of producers can send to it without being accepted. Notifications are
+// framed so that producers can batch them with ipc_dgram_packer. If creds is
+// set, the sender credentials are reported by ipc_dgram_recv.
+// returns file descriptor or -ve on error
+int ipc_unix_dgram_listen(const char *path, bool creds);
+// returns an unbound datagram socket or -ve on error
+int ipc_unix_dgram_socket(void);
+// returns datagram socket connected to path or -ve on error
+int ipc_unix_dgram_connect(const char *path);
+// returns zero on success, non-zero on error
+int ipc_unix_sendto(int fd, const char *path, const char *buf, int sz);
+
+// Ancillary streams. ipc_stream_send creates a pipe, sends the message along
+// with one end of the pipe and returns the other end. If local_write is set
+// the caller keeps the write end and streams data to the remote, otherwise
+// the remote writes into the pipe and the caller reads from it.
+// returns file descriptor or -ve on error
+int ipc_stream_send(int fd, const char *buf, int sz, bool local_write);
+
+// Default capacity ipc_stream_send requests for its pipes
+#define IPC_STREAM_PIPE_SIZE (1 << 20)
+
+// Grows the pipe buffer (F_SETPIPE_SZ) so that large transfers need fewer
+// context switches.
+// returns the new size or -ve on error
+int ipc_stream_pipe_size(int pipe, int size);
+
+// Moves n bytes, or until EOF if n is -ve, from in to out. One of the two
+// should be a pipe so that the data can be moved with splice without passing
+// through user space. Falls back to read/write where splice is unavailable.
+// returns # of bytes moved or -ve on error
+long long ipc_stream_copy(int in, int out, long long n);
+
+// Maps user memory into a pipe with vmsplice. The memory must not be
+// modified until the reader has consumed it.
+// returns # of bytes written or -ve on error
+long long ipc_stream_write(int pipe, const void *buf, long long n);
+
+// Duplicates up to n bytes from the in pipe to the out pipe with tee without
+// consuming them.
+// returns # of bytes duplicated, 0 on EOF or -ve on error
+long long ipc_stream_tee(int in, int out, long long n);
+
+// Busy polling for latency critical paths. ipc_unix_recvmsg_spin spins on a
+// non-blocking receive for up to budget_ns before falling back to a blocking
+// receive. This avoids the wakeup latency of a blocking receive on an
+// otherwise idle core. The counters report how often spinning paid off so
+// that the budget can be tuned. A budget of zero disables spinning.
+struct ipc_spin {
+	long budget_ns;
+	// receives satisfied while spinning
+	unsigned long hits;
+	// receives that fell back to blocking
+	unsigned long misses;
+	// total time spent spinning
+	unsigned long long spin_ns;
+};
+
+// same return values as ipc_unix_recvmsg
+int ipc_unix_recvmsg_spin(int fd, char *buf, int sz, int *fds, int *fdn,
+			  struct ipc_spin *s);
+
+// Pins the calling thread to a CPU. Spinning is best paired with a dedicated
+// core.
+// returns zero on success, non-zero on error
+int ipc_pin_cpu(int cpu);
+
+// UDP transport. Messages must be framed (see sipc_frame) and each datagram
+// can carry several of them. The host may be NULL for the wildcard/loopback
+// address. Returns file descriptor or -ve on error.
+int ipc_udp_bind(const char *host, const char *port);
+int ipc_udp_connect(const char *host, const char *port);
+
+// Largest payload of a UDP datagram over IPv4
+#define IPC_UDP_MAX 65507
+
+// Packs framed messages into datagrams on a connected datagram socket.
+// Messages are appended to buf until the next one does not fit, at which
+// point the pending datagram is sent.
+struct ipc_dgram_packer {
+	int fd;
+	int len;
+	int cap;
+	char *buf;
+	// number of datagrams sent
+	unsigned long sent;
+};
+
+void ipc_dgram_init(struct ipc_dgram_packer *w, int fd, char *buf, int cap);
+
+// Formats (see sipc_format) and frames a message into the pending datagram.
+// The format must not include the frame header, but must end with a newline.
+// returns zero on success, non-zero on error
+int ipc_dgram_format(struct ipc_dgram_packer *w, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+int ipc_dgram_vformat(struct ipc_dgram_packer *w, const char *fmt, va_list ap)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 0)))
+#endif
+	;
+
+// Appends an already framed message
+// returns zero on success, non-zero on error
+int ipc_dgram_append(struct ipc_dgram_packer *w, const char *msg, int sz);
+
+// Sends the pending datagram if any
+// returns zero on success, non-zero on error
+int ipc_dgram_flush(struct ipc_dgram_packer *w);
+
+struct ipc_dgram {
+	char *buf;
+	int cap;
+	// filled out with the received size
+	int len;
+	// filled out with the sender credentials on unix datagram sockets
+	// with creds enabled, otherwise -1
+	int pid;
+	int uid;
+	int gid;
+};
+
+// Receives a burst of datagrams with a single recvmmsg where available.
+// Blocks until at least one datagram is available, then collects any others
+// that are already queued.
+// returns # of datagrams received
+// -ve on error - check errno
+int ipc_dgram_recv(int fd, struct ipc_dgram *v, int n);
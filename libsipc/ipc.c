@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include "ipc.h"
+#include "ipc-trace.h"
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -580,6 +581,30 @@ enum sipc_msg_type sipc_start(sipc_parser_t *p)
 	}
 }
 
+int sipc_request_id(sipc_parser_t *p, uint64_t *pid)
+{
+	if (sipc_peek(p) != SIPC_REQUEST_ID) {
+		return 0;
+	}
+	sipc_start(p);
+	if (sipc_uint64(p, pid) || sipc_end(p)) {
+		return -1;
+	}
+	return 1;
+}
+
+int sipc_deadline(sipc_parser_t *p, double *psecs)
+{
+	if (sipc_peek(p) != SIPC_DEADLINE) {
+		return 0;
+	}
+	sipc_start(p);
+	if (sipc_double(p, psecs) || sipc_end(p)) {
+		return -1;
+	}
+	return 1;
+}
+
 int sipc_end(sipc_parser_t *p)
 {
 	sipc_any_t any;
@@ -923,17 +948,44 @@ int sipc_unframe(sipc_parser_t *p, const char *buf, int sz)
 	}
 
 	int msgsz = (hex_value(buf[0]) << 12) | (hex_value(buf[1]) << 8) |
-		    (hex_value(buf[2] << 4)) | hex_value(buf[3]);
+		    (hex_value(buf[2]) << 4) | hex_value(buf[3]);
 
-	if (msgsz >= sz) {
+	if (msgsz < 6) {
+		// too small to hold the header and a submessage
+		return -1;
+	}
+
+	if (msgsz <= sz) {
 		if (sipc_init(p, buf + 5, msgsz - 5)) {
 			return -1;
 		}
+		SIPC_PROBE(unframe, buf, msgsz);
 	}
 
 	return msgsz;
 }
 
+void sipc_unframe_init(sipc_unframer_t *u, const char *buf, int sz)
+{
+	u->next = buf;
+	u->end = buf + sz;
+}
+
+int sipc_unframe_next(sipc_unframer_t *u, sipc_parser_t *p)
+{
+	int sz = (int)(u->end - u->next);
+	if (!sz) {
+		return 0;
+	}
+	int msgsz = sipc_unframe(p, u->next, sz);
+	if (msgsz <= 0 || msgsz > sz) {
+		// a datagram must not end with a partial message
+		return -1;
+	}
+	u->next += msgsz;
+	return msgsz;
+}
+
 int sipc_init(sipc_parser_t *p, const char *buf, int sz)
 {
 	if (sz < 1 || buf[sz - 1] != '\n') {
@@ -10,6 +10,9 @@ enum sipc_msg_type {
 	SIPC_ERROR = 'E',
 	SIPC_SUCCESS = 'S',
 	SIPC_WINDOWS_HANDLE = 'W',
+	SIPC_REQUEST_ID = 'I',
+	SIPC_DEADLINE = 'D',
+	SIPC_PART = 'P',
 };
 
 enum sipc_type {
@@ -68,6 +71,23 @@ int sipc_double(sipc_parser_t *p, double *pv);
 int sipc_string(sipc_parser_t *p, int *pn, const char **ps);
 int sipc_bytes(sipc_parser_t *p, int *pn, const unsigned char **pp);
 
+// Parses an optional request ID submessage (I <id>). Tagged requests are
+// replied to with the same ID before the S or E submessage, which lets the
+// server reply out of order.
+// returns
+// -ve on error
+// 0 if the message is untagged
+// 1 if pid has been filled out
+int sipc_request_id(sipc_parser_t *p, uint64_t *pid);
+
+// Parses an optional deadline submessage (D <seconds>), which follows the
+// request ID if any. The deadline is relative to when the request was sent.
+// returns
+// -ve on error
+// 0 if the message has no deadline
+// 1 if psecs has been filled out
+int sipc_deadline(sipc_parser_t *p, double *psecs);
+
 // These format a message using printf like syntax to aid in formatting
 // an IPC message. The following printf specifiers are supported
 // - %o - bool
@@ -108,5 +128,19 @@ void sipc_frame(char *buf, int sz);
 // -ve on error
 // 0 if more data is needed
 // > 0 number of bytes in the message
-// if ret >= sz, then p is setup to parse the message
+// if ret <= sz, then p is setup to parse the message
 int sipc_unframe(sipc_parser_t *p, const char *buf, int sz);
+
+// Iterates over a buffer holding a sequence of complete framed messages
+// (e.g. a datagram). sipc_unframe_next returns
+// -ve on error (including a trailing partial message)
+// 0 once the buffer has been consumed
+// > 0 number of bytes in the message, p is setup to parse the message
+struct sipc_unframer {
+	const char *next;
+	const char *end;
+};
+typedef struct sipc_unframer sipc_unframer_t;
+
+void sipc_unframe_init(sipc_unframer_t *u, const char *buf, int sz);
+int sipc_unframe_next(sipc_unframer_t *u, sipc_parser_t *p);
@@ -144,6 +144,81 @@ static void test_parse()
 	assert(p.next == p.end && !*p.next);
 }
 
+static void test_request_id()
+{
+	char buf[64];
+	int n = sipc_format(buf, sizeof(buf), "I %llu\nS %d\n",
+			    (unsigned long long)0x1234, 5);
+	assert(n == 11 && !strcmp(buf, "I 1234\nS 5\n"));
+
+	sipc_parser_t p;
+	uint64_t id;
+	assert(!sipc_init(&p, buf, n));
+	assert(sipc_request_id(&p, &id) == 1 && id == 0x1234);
+	assert(sipc_start(&p) == SIPC_SUCCESS);
+
+	assert(!sipc_init(&p, "R 4:ping\n", 9));
+	assert(sipc_request_id(&p, &id) == 0);
+	assert(sipc_start(&p) == SIPC_REQUEST);
+
+	assert(!sipc_init(&p, "I -1\nR 4:ping\n", 14));
+	assert(sipc_request_id(&p, &id) < 0);
+}
+
+static void test_deadline()
+{
+	char buf[64];
+	int n = sipc_format(buf, sizeof(buf), "I %d\nD %f\nR 4:ping\n", 7,
+			    0.25);
+	assert(n > 0);
+
+	sipc_parser_t p;
+	uint64_t id;
+	double secs;
+	assert(!sipc_init(&p, buf, n));
+	assert(sipc_request_id(&p, &id) == 1 && id == 7);
+	assert(sipc_deadline(&p, &secs) == 1 && secs == 0.25);
+	assert(sipc_start(&p) == SIPC_REQUEST);
+
+	assert(!sipc_init(&p, "R 4:ping\n", 9));
+	assert(sipc_deadline(&p, &secs) == 0);
+
+	assert(!sipc_init(&p, "D 3:abc\nR 4:ping\n", 17));
+	assert(sipc_deadline(&p, &secs) < 0);
+}
+
+static void test_unframe()
+{
+	char buf[64];
+	int n = 0;
+	strcpy(buf, "0000\nR 3:abc\n");
+	sipc_frame(buf, 13);
+	n += 13;
+	strcpy(buf + n, "0000\nS 1\n");
+	sipc_frame(buf + n, 9);
+	n += 9;
+	assert(!strncmp(buf, "000d\nR 3:abc\n0009\n", 18));
+
+	sipc_parser_t p;
+	assert(sipc_unframe(&p, buf, 4) == 0);
+	assert(sipc_unframe(&p, buf, 10) == 13);
+	assert(sipc_unframe(&p, buf, n) == 13);
+	assert(p.next == buf + 5 && p.end == buf + 13);
+
+	sipc_unframer_t u;
+	sipc_unframe_init(&u, buf, n);
+	assert(sipc_unframe_next(&u, &p) == 13);
+	assert(sipc_start(&p) == SIPC_REQUEST && !sipc_end(&p));
+	assert(sipc_unframe_next(&u, &p) == 9);
+	assert(sipc_start(&p) == SIPC_SUCCESS && !sipc_end(&p));
+	assert(sipc_unframe_next(&u, &p) == 0);
+
+	// trailing partial message
+	sipc_unframe_init(&u, buf, n - 1);
+	assert(sipc_unframe_next(&u, &p) == 13);
+	assert(sipc_unframe_next(&u, &p) < 0);
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc > 1) {
@@ -152,5 +227,8 @@ int main(int argc, char *argv[])
 	test_hex();
 	test_format();
 	test_parse();
+	test_unframe();
+	test_request_id();
+	test_deadline();
 	return 0;
 }
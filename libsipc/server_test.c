@@ -0,0 +1,641 @@
+#include "ipc-server.c"
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SOCK_PATH "server_test.sock"
+
+static atomic_int pings;
+
+static void ping_handler(void *udata, struct ipc_request *r,
+			 sipc_parser_t *args)
+{
+	atomic_fetch_add(&pings, 1);
+	ipc_reply(r, "S 4:pong\n");
+}
+
+static atomic_int blocked;
+
+// holds up its worker until blocked is cleared
+static void block_handler(void *udata, struct ipc_request *r,
+			  sipc_parser_t *args)
+{
+	atomic_store(&blocked, 2);
+	while (atomic_load(&blocked)) {
+		struct timespec ts = { .tv_nsec = 1000000 };
+		nanosleep(&ts, NULL);
+	}
+	ipc_reply(r, "S\n");
+}
+
+// streams large parts and then holds up its worker like block_handler
+static void stream_handler(void *udata, struct ipc_request *r,
+			   sipc_parser_t *args)
+{
+	static char part[32768];
+	memset(part, 'x', sizeof(part));
+	for (int i = 0; i < 12; i++) {
+		ipc_reply_part(r, "P %.*s\n", (int)sizeof(part), part);
+	}
+	block_handler(udata, r, args);
+}
+
+// sends a request and returns the length of the first reply
+static int call(int fd, const char *req, char *buf, int sz)
+{
+	int n = (int)strlen(req);
+	assert(ipc_unix_sendmsg(fd, req, n, NULL, 0) == n);
+	return ipc_unix_recvmsg(fd, buf, sz, NULL, NULL);
+}
+
+// takes over from the server like a successor would, returning the number
+// of connections received
+static int take_over(int fd)
+{
+	static const char req[] = "I 1\nR 8:handover\n";
+	assert(ipc_unix_sendmsg(fd, req, sizeof(req) - 1, NULL, 0) ==
+	       sizeof(req) - 1);
+	int conns = 0;
+	for (;;) {
+		char buf[256];
+		int fds[16];
+		int fdn = 16;
+		int n = ipc_unix_recvmsg(fd, buf, sizeof(buf), fds, &fdn);
+		assert(n > 4 && !memcmp(buf, "I 1\n", 4));
+		for (int i = 0; i < fdn; i++) {
+			close(fds[i]);
+		}
+		if (buf[4] == 'S') {
+			return conns;
+		} else if (n == 15 && !memcmp(buf + 4, "P 6:listen\n", 11)) {
+			assert(fdn == 1);
+		} else {
+			assert(n == 13 && !memcmp(buf + 4, "P 4:conn\n", 9));
+			conns += fdn;
+		}
+	}
+}
+
+static void test_handover_gone()
+{
+	unlink(SOCK_PATH);
+	int lfd = ipc_unix_listen(SOCK_PATH);
+	assert(lfd >= 0);
+
+	// a successor that asks for the listening socket and goes away before
+	// the server gets to it
+	static const char req[] = "I 1\nR 8:handover\n";
+	int gone = ipc_unix_connect(SOCK_PATH);
+	assert(gone >= 0);
+	assert(ipc_unix_sendmsg(gone, req, sizeof(req) - 1, NULL, 0) ==
+	       sizeof(req) - 1);
+	close(gone);
+
+	// thread-per-core so that handover, a high priority verb, runs
+	// before the ping below
+	struct ipc_server_config cfg = {
+		.io_threads = 1,
+		.per_core = true,
+		.handover = true,
+	};
+	struct ipc_server *s = ipc_server_new(&cfg);
+	assert(s);
+	assert(!ipc_server_handle(s, "ping", &ping_handler, NULL));
+	assert(!ipc_server_start(s, lfd));
+
+	// still accepting
+	char buf[256];
+	int fd = ipc_unix_connect(SOCK_PATH);
+	assert(fd >= 0);
+	int n = call(fd, "R 4:ping\n", buf, sizeof(buf));
+	assert(n == 9 && !memcmp(buf, "S 4:pong\n", 9));
+
+	// and another successor can take over
+	int next = ipc_unix_connect(SOCK_PATH);
+	assert(next >= 0);
+	assert(take_over(next) == 1);
+	ipc_server_wait(s);
+
+	close(fd);
+	close(next);
+	ipc_server_stop(s);
+	ipc_server_free(s);
+	unlink(SOCK_PATH);
+}
+
+static void test_wheel()
+{
+	enum { N = 7 };
+	struct wheel w = { 0 };
+	struct ipc_request r[N + 1];
+	memset(r, 0, sizeof(r));
+	long long start = monotonic_ns() / 1000000;
+	// due within level 0, level 1 and level 2 and beyond level 2's range
+	r[0].expires_ms = start + 100;
+	r[1].expires_ms = start + 1000;
+	r[2].expires_ms = start + 20000;
+	r[3].expires_ms = start + 300000;
+	r[4].expires_ms = start + 2000000;
+	// and on the ticks where level 1 and level 2 slots cascade
+	r[5].expires_ms = ((start >> 8) + 4) << 8;
+	r[6].expires_ms = ((start >> 14) + 4) << 14;
+	for (int i = 0; i < N; i++) {
+		timer_add(&w, &r[i]);
+	}
+	// and one taken off again
+	r[N].expires_ms = start + 50000;
+	timer_add(&w, &r[N]);
+	timer_del(&w, &r[N]);
+
+	// each timer comes due on its tick as it cascades down the levels
+	bool fired[N] = { false };
+	for (long long now = w.now + 1; w.count; now++) {
+		assert(now <= r[4].expires_ms);
+		struct ipc_request *d = wheel_expire(&w, now);
+		for (; d != NULL; d = d->tnext) {
+			int i = (int)(d - r);
+			assert(i < N && !fired[i] && d->expires_ms == now);
+			fired[i] = true;
+		}
+	}
+	for (int i = 0; i < N; i++) {
+		assert(fired[i]);
+	}
+}
+
+static void test_deadline()
+{
+	unlink(SOCK_PATH);
+	int lfd = ipc_unix_listen(SOCK_PATH);
+	assert(lfd >= 0);
+	struct ipc_server_config cfg = { .io_threads = 1, .workers = 1 };
+	struct ipc_server *s = ipc_server_new(&cfg);
+	assert(s);
+	assert(!ipc_server_handle(s, "block", &block_handler, NULL));
+	assert(!ipc_server_handle(s, "ping", &ping_handler, NULL));
+	assert(!ipc_server_start(s, lfd));
+
+	int bfd = ipc_unix_connect(SOCK_PATH);
+	assert(bfd >= 0);
+	atomic_store(&blocked, 1);
+	assert(ipc_unix_sendmsg(bfd, "R 5:block\n", 10, NULL, 0) == 10);
+	while (atomic_load(&blocked) != 2) {
+		usleep(1000);
+	}
+
+	// a deadline past level 0 that expires while the request is queued
+	int fd = ipc_unix_connect(SOCK_PATH);
+	assert(fd >= 0);
+	char buf[256];
+	int n = sipc_format(buf, sizeof(buf), "D %f\nR 4:ping\n", 0.3);
+	long long sent = monotonic_ns();
+	assert(n > 0 && ipc_unix_sendmsg(fd, buf, n, NULL, 0) == n);
+	n = ipc_unix_recvmsg(fd, buf, sizeof(buf), NULL, NULL);
+	long long ms = (monotonic_ns() - sent) / 1000000;
+	assert(n > 12 && !memcmp(buf, "E 7:timeout ", 12));
+	assert(ms >= 300 && ms < 1000);
+
+	atomic_store(&blocked, 0);
+	n = ipc_unix_recvmsg(bfd, buf, sizeof(buf), NULL, NULL);
+	assert(n == 2 && buf[0] == 'S');
+	// the worker drops the expired request without running it
+	atomic_store(&pings, 0);
+	n = call(fd, "R 4:ping\n", buf, sizeof(buf));
+	assert(n == 9 && atomic_load(&pings) == 1);
+
+	close(fd);
+	close(bfd);
+	ipc_server_stop(s);
+	ipc_server_free(s);
+	unlink(SOCK_PATH);
+}
+
+// gets key, returning whether the reply came from the cache
+static bool get(struct ipc_server *s, int fd, const char *key)
+{
+	struct ipc_io_stats st;
+	assert(ipc_server_io_stats(s, &st, 1) == 1);
+	unsigned long hits = st.cache_hits;
+	char req[64];
+	char buf[64];
+	int n = sipc_format(req, sizeof(req), "R 3:get %s\n", key);
+	assert(n > 0 && call(fd, req, buf, sizeof(buf)) == 9);
+	assert(ipc_server_io_stats(s, &st, 1) == 1);
+	return st.cache_hits > hits;
+}
+
+static void test_cache()
+{
+	// keys of the same length landing in the same shard, which has room
+	// for three entries
+	char keys[4][8];
+	int nkeys = 0;
+	int shard = -1;
+	for (int i = 0; nkeys < 4; i++) {
+		char req[64];
+		snprintf(keys[nkeys], sizeof(keys[nkeys]), "k%04d", i % 10000);
+		int n = sipc_format(req, sizeof(req), "R 3:get %s\n",
+				    keys[nkeys]);
+		int sh = (int)(cache_hash(req, n) % CACHE_SHARDS);
+		if (shard < 0 || sh == shard) {
+			shard = sh;
+			nkeys++;
+		}
+	}
+	size_t entry = sizeof(struct cache_entry) +
+		       strlen("R 3:get 5:k0000\n") + strlen("S 4:pong\n");
+
+	unlink(SOCK_PATH);
+	int lfd = ipc_unix_listen(SOCK_PATH);
+	assert(lfd >= 0);
+	struct ipc_server_config cfg = {
+		.io_threads = 1,
+		.workers = 1,
+		.cache_bytes = CACHE_SHARDS * 3 * entry,
+	};
+	struct ipc_server *s = ipc_server_new(&cfg);
+	assert(s);
+	assert(!ipc_server_handle(s, "get", &ping_handler, NULL));
+	assert(!ipc_server_cache(s, "get"));
+	assert(!ipc_server_start(s, lfd));
+	int fd = ipc_unix_connect(SOCK_PATH);
+	assert(fd >= 0);
+	atomic_store(&pings, 0);
+
+	for (int i = 0; i < 3; i++) {
+		assert(!get(s, fd, keys[i]));
+	}
+	assert(get(s, fd, keys[0]) && atomic_load(&pings) == 3);
+
+	// the hand passes over the entry that was hit and evicts the next
+	assert(!get(s, fd, keys[3]));
+	assert(get(s, fd, keys[0]));
+	assert(get(s, fd, keys[3]));
+	assert(!get(s, fd, keys[1]) && atomic_load(&pings) == 5);
+
+	// invalidated entries miss until the reply is cached again
+	assert(!ipc_server_invalidate(s, "get"));
+	assert(!get(s, fd, keys[0]));
+	assert(get(s, fd, keys[0]) && atomic_load(&pings) == 6);
+	assert(ipc_server_invalidate(s, "none"));
+
+	close(fd);
+	ipc_server_stop(s);
+	ipc_server_free(s);
+	unlink(SOCK_PATH);
+}
+
+// pings, returning whether the request was admitted
+static bool admitted(int fd)
+{
+	static const char shed[] = "E a:overloaded 13:rate limit exceeded\n";
+	char buf[64];
+	int n = call(fd, "R 4:ping\n", buf, sizeof(buf));
+	if (n == 9 && !memcmp(buf, "S 4:pong\n", 9)) {
+		return true;
+	}
+	assert(n == sizeof(shed) - 1 && !memcmp(buf, shed, n));
+	return false;
+}
+
+static void test_rate_limit()
+{
+	unlink(SOCK_PATH);
+	int lfd = ipc_unix_listen(SOCK_PATH);
+	assert(lfd >= 0);
+	// a request every 100ms with a burst of three
+	struct ipc_server_config cfg = {
+		.io_threads = 1,
+		.workers = 1,
+		.rate = 10,
+		.burst = 3,
+	};
+	struct ipc_server *s = ipc_server_new(&cfg);
+	assert(s);
+	assert(!ipc_server_handle(s, "ping", &ping_handler, NULL));
+	assert(!ipc_server_start(s, lfd));
+	int fd = ipc_unix_connect(SOCK_PATH);
+	assert(fd >= 0);
+	int other = ipc_unix_connect(SOCK_PATH);
+	assert(other >= 0);
+
+	for (int i = 0; i < 3; i++) {
+		assert(admitted(fd));
+	}
+	assert(!admitted(fd));
+	// connections from the same user share the limit
+	assert(!admitted(other));
+
+	// room for one more after a little over an interval
+	usleep(150000);
+	assert(admitted(other));
+	assert(!admitted(fd));
+	struct ipc_io_stats st;
+	assert(ipc_server_io_stats(s, &st, 1) == 1 && st.shed == 3);
+
+	close(fd);
+	close(other);
+	ipc_server_stop(s);
+	ipc_server_free(s);
+	unlink(SOCK_PATH);
+}
+
+static char order[16];
+static atomic_int ordern;
+
+// records the class it was registered for
+static void class_handler(void *udata, struct ipc_request *r,
+			  sipc_parser_t *args)
+{
+	order[atomic_fetch_add(&ordern, 1)] = *(const char *)udata;
+	ipc_reply(r, "S\n");
+}
+
+// queues bulk, normal and high priority requests in that order behind a
+// blocked worker and returns the order they ran in
+static const char *run_order(enum ipc_sched sched, const int *weights)
+{
+	unlink(SOCK_PATH);
+	int lfd = ipc_unix_listen(SOCK_PATH);
+	assert(lfd >= 0);
+	struct ipc_server_config cfg = {
+		.io_threads = 1,
+		.workers = 1,
+		.sched = sched,
+	};
+	memcpy(cfg.weights, weights, sizeof(cfg.weights));
+	struct ipc_server *s = ipc_server_new(&cfg);
+	assert(s);
+	assert(!ipc_server_handle(s, "block", &block_handler, NULL));
+	assert(!ipc_server_handle_priority(s, "hi", &class_handler, "H",
+					   IPC_PRIORITY_HIGH));
+	assert(!ipc_server_handle_priority(s, "mid", &class_handler, "N",
+					   IPC_PRIORITY_NORMAL));
+	assert(!ipc_server_handle_priority(s, "lo", &class_handler, "B",
+					   IPC_PRIORITY_BULK));
+	assert(!ipc_server_start(s, lfd));
+
+	int bfd = ipc_unix_connect(SOCK_PATH);
+	assert(bfd >= 0);
+	atomic_store(&blocked, 1);
+	assert(ipc_unix_sendmsg(bfd, "R 5:block\n", 10, NULL, 0) == 10);
+	while (atomic_load(&blocked) != 2) {
+		usleep(1000);
+	}
+
+	static const char *const reqs[] = {
+		"I 1\nR 2:lo\n",  "I 2\nR 2:lo\n",  "I 3\nR 3:mid\n",
+		"I 4\nR 3:mid\n", "I 5\nR 2:hi\n",  "I 6\nR 2:hi\n",
+		"I 7\nR 2:hi\n",  "I 8\nR 2:hi\n",
+	};
+	int fd = ipc_unix_connect(SOCK_PATH);
+	assert(fd >= 0);
+	for (int i = 0; i < 8; i++) {
+		int n = (int)strlen(reqs[i]);
+		assert(ipc_unix_sendmsg(fd, reqs[i], n, NULL, 0) == n);
+	}
+	while (atomic_load(&s->queued) < 8) {
+		usleep(1000);
+	}
+	memset(order, 0, sizeof(order));
+	atomic_store(&ordern, 0);
+	atomic_store(&blocked, 0);
+	char buf[64];
+	for (int i = 0; i < 8; i++) {
+		assert(ipc_unix_recvmsg(fd, buf, sizeof(buf), NULL, NULL) > 0);
+	}
+	assert(ipc_unix_recvmsg(bfd, buf, sizeof(buf), NULL, NULL) == 2);
+
+	close(fd);
+	close(bfd);
+	ipc_server_stop(s);
+	ipc_server_free(s);
+	unlink(SOCK_PATH);
+	return order;
+}
+
+static void test_priority()
+{
+	static const int none[IPC_PRIORITIES] = { 0 };
+	static const int weights[IPC_PRIORITIES] = { 2, 1, 1 };
+	assert(!strcmp(run_order(IPC_SCHED_STRICT, none), "HHHHNNBB"));
+	// two high priority requests for each of the others in turn, after
+	// the blocking request has used up the normal class's first turn
+	assert(!strcmp(run_order(IPC_SCHED_WEIGHTED, weights), "HHBHHNBN"));
+}
+
+static void test_coalesce_expired()
+{
+	unlink(SOCK_PATH);
+	int lfd = ipc_unix_listen(SOCK_PATH);
+	assert(lfd >= 0);
+	struct ipc_server_config cfg = { .io_threads = 1, .workers = 1 };
+	struct ipc_server *s = ipc_server_new(&cfg);
+	assert(s);
+	assert(!ipc_server_handle(s, "block", &block_handler, NULL));
+	assert(!ipc_server_handle(s, "ping", &ping_handler, NULL));
+	assert(!ipc_server_coalesce(s, "ping"));
+	assert(!ipc_server_start(s, lfd));
+
+	// occupy the only worker
+	int bfd = ipc_unix_connect(SOCK_PATH);
+	assert(bfd >= 0);
+	atomic_store(&blocked, 1);
+	assert(ipc_unix_sendmsg(bfd, "R 5:block\n", 10, NULL, 0) == 10);
+	while (atomic_load(&blocked) != 2) {
+		usleep(1000);
+	}
+
+	// a leader that expires while queued and requests waiting on it,
+	// two without a deadline and one with the same short deadline
+	int fd = ipc_unix_connect(SOCK_PATH);
+	assert(fd >= 0);
+	char req[64];
+	int n = sipc_format(req, sizeof(req), "I 1\nD %f\nR 4:ping\n", 0.02);
+	assert(n > 0 && ipc_unix_sendmsg(fd, req, n, NULL, 0) == n);
+	for (int i = 2; i <= 3; i++) {
+		n = sipc_format(req, sizeof(req), "I %d\nR 4:ping\n", i);
+		assert(ipc_unix_sendmsg(fd, req, n, NULL, 0) == n);
+	}
+	n = sipc_format(req, sizeof(req), "I 4\nD %f\nR 4:ping\n", 0.02);
+	assert(ipc_unix_sendmsg(fd, req, n, NULL, 0) == n);
+
+	char buf[256];
+	n = ipc_unix_recvmsg(fd, buf, sizeof(buf), NULL, NULL);
+	assert(n > 6 && !memcmp(buf, "I 1\nE 7:timeout ", 16));
+	usleep(20000);
+	atomic_store(&pings, 0);
+	atomic_store(&blocked, 0);
+
+	// once the worker gets to the expired leader, the waiters without a
+	// deadline get a reply from one of them running the handler
+	bool replied[5] = { false };
+	for (int i = 2; i <= 4; i++) {
+		n = ipc_unix_recvmsg(fd, buf, sizeof(buf), NULL, NULL);
+		assert(n > 4 && !memcmp(buf, "I ", 2));
+		int id = buf[2] - '0';
+		assert(id >= 2 && id <= 4 && !replied[id]);
+		replied[id] = true;
+		if (id == 4) {
+			assert(!memcmp(buf + 4, "E 7:timeout ", 12));
+		} else {
+			assert(n == 13 && !memcmp(buf + 4, "S 4:pong\n", 9));
+		}
+	}
+	assert(atomic_load(&pings) == 1);
+	n = ipc_unix_recvmsg(bfd, buf, sizeof(buf), NULL, NULL);
+	assert(n == 2 && buf[0] == 'S');
+	struct ipc_io_stats st;
+	assert(ipc_server_io_stats(s, &st, 1) == 1 && st.coalesced == 3);
+
+	close(fd);
+	close(bfd);
+	ipc_server_stop(s);
+	ipc_server_free(s);
+	unlink(SOCK_PATH);
+}
+
+static void test_inflight_parts()
+{
+	unlink(SOCK_PATH);
+	int lfd = ipc_unix_listen(SOCK_PATH);
+	assert(lfd >= 0);
+	struct ipc_server_config cfg = {
+		.io_threads = 1,
+		.workers = 2,
+		.max_inflight = 2,
+	};
+	struct ipc_server *s = ipc_server_new(&cfg);
+	assert(s);
+	assert(!ipc_server_handle(s, "stream", &stream_handler, NULL));
+	assert(!ipc_server_handle(s, "ping", &ping_handler, NULL));
+	assert(!ipc_server_start(s, lfd));
+
+	// parts the socket can't take yet don't count against the limit
+	int fd = ipc_unix_connect(SOCK_PATH);
+	assert(fd >= 0);
+	atomic_store(&blocked, 1);
+	assert(ipc_unix_sendmsg(fd, "I 1\nR 6:stream\n", 15, NULL, 0) == 15);
+	while (atomic_load(&blocked) != 2) {
+		usleep(1000);
+	}
+	usleep(20000);
+	assert(ipc_unix_sendmsg(fd, "I 2\nR 4:ping\n", 13, NULL, 0) == 13);
+
+	static char buf[65536];
+	int parts = 0;
+	for (;;) {
+		int n = ipc_unix_recvmsg(fd, buf, sizeof(buf), NULL, NULL);
+		assert(n > 4);
+		if (buf[2] == '2') {
+			assert(n == 13 && !memcmp(buf + 4, "S 4:pong\n", 9));
+			break;
+		}
+		assert(!memcmp(buf, "I 1\nP ", 6));
+		parts++;
+	}
+	atomic_store(&blocked, 0);
+	for (;;) {
+		int n = ipc_unix_recvmsg(fd, buf, sizeof(buf), NULL, NULL);
+		assert(n > 4 && !memcmp(buf, "I 1\n", 4));
+		if (buf[4] == 'S') {
+			break;
+		}
+		parts++;
+	}
+	assert(parts == 12);
+
+	close(fd);
+	ipc_server_stop(s);
+	ipc_server_free(s);
+	unlink(SOCK_PATH);
+}
+
+static void test_handover_killed()
+{
+	unlink(SOCK_PATH);
+	int lfd = ipc_unix_listen(SOCK_PATH);
+	assert(lfd >= 0);
+	struct ipc_server_config cfg = {
+		.io_threads = 2,
+		.workers = 2,
+		.handover = true,
+	};
+	struct ipc_server *s = ipc_server_new(&cfg);
+	assert(s);
+	assert(!ipc_server_handle(s, "block", &block_handler, NULL));
+	assert(!ipc_server_handle(s, "ping", &ping_handler, NULL));
+	assert(!ipc_server_start(s, lfd));
+
+	// a connection that can't be handed over while its request runs
+	int bfd = ipc_unix_connect(SOCK_PATH);
+	assert(bfd >= 0);
+	atomic_store(&blocked, 1);
+	assert(ipc_unix_sendmsg(bfd, "R 5:block\n", 10, NULL, 0) == 10);
+	while (atomic_load(&blocked) != 2) {
+		usleep(1000);
+	}
+
+	// a successor that dies once it has the listening socket
+	static const char req[] = "I 1\nR 8:handover\n";
+	int dead = ipc_unix_connect(SOCK_PATH);
+	assert(dead >= 0);
+	assert(ipc_unix_sendmsg(dead, req, sizeof(req) - 1, NULL, 0) ==
+	       sizeof(req) - 1);
+	char buf[256];
+	int fds[16];
+	int fdn = 16;
+	int n = ipc_unix_recvmsg(dead, buf, sizeof(buf), fds, &fdn);
+	assert(n == 15 && !memcmp(buf, "I 1\nP 6:listen\n", 15) && fdn == 1);
+	close(fds[0]);
+	close(dead);
+
+	// the server goes on accepting
+	int fd = ipc_unix_connect(SOCK_PATH);
+	assert(fd >= 0);
+	n = call(fd, "R 4:ping\n", buf, sizeof(buf));
+	assert(n == 9 && !memcmp(buf, "S 4:pong\n", 9));
+
+	// and kept the connection it didn't get to hand over
+	atomic_store(&blocked, 0);
+	n = ipc_unix_recvmsg(bfd, buf, sizeof(buf), NULL, NULL);
+	assert(n == 2 && buf[0] == 'S');
+	n = call(bfd, "R 4:ping\n", buf, sizeof(buf));
+	assert(n == 9 && !memcmp(buf, "S 4:pong\n", 9));
+
+	// another successor gets both connections
+	int next = ipc_unix_connect(SOCK_PATH);
+	assert(next >= 0);
+	assert(take_over(next) == 2);
+	ipc_server_wait(s);
+
+	close(fd);
+	close(bfd);
+	close(next);
+	ipc_server_stop(s);
+	ipc_server_free(s);
+	unlink(SOCK_PATH);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		freopen(argv[1], "w", stderr);
+	}
+	// a wedged server fails the test rather than hanging it
+	alarm(30);
+	test_handover_gone();
+	test_handover_killed();
+	test_wheel();
+	test_deadline();
+	test_cache();
+	test_coalesce_expired();
+	test_inflight_parts();
+	test_rate_limit();
+	test_priority();
+	return 0;
+}